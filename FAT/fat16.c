@@ -1,6 +1,7 @@
 #include <time.h>
 #include <assert.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/timeb.h>
@@ -52,265 +53,1620 @@ cluster_t sector_cluster(sector_t sec) {
     return clus;
 }
 
-cluster_t read_fat_entry(cluster_t clus)
-{
-    char sector_buffer[MAX_LOGICAL_SECTOR_SIZE];
-    /**
-     * TASK 4.1
-     * TODO:
-     *   Read the FAT table entry [~5 lines of code]
-     * 
-     * Hint:
-     *   You need to read the FAT table entry corresponding to `clus` and then 
-     *   return the value of that entry.
-     * 
-     *   - Which sector is the FAT table entry located?
-     *   - What is the offset within that sector?
-     *   - What is the size of the entry?
-     */
+/* In-memory copy of the first FAT table. It is loaded once in `fat16_init()`,
+   `read_fat_entry()` answers lookups from it and `write_fat_entry()` keeps it
+   in sync with every FAT copy on disk. A bitmap of the free clusters is kept
+   next to it, so the allocator skips 64 used clusters per word it tests.
+   Everything here is protected by `fat_lock`: lookups take it shared,
+   updates and allocations take it exclusively.
+
+   With --lazy, the table is instead filled after mount by `fat_load_main()`.
+   Until it is complete, `read_fat_entry()` reads entries past `loaded` from
+   disk, and whatever changes the FAT or needs the free bitmap waits in
+   `fat_cache_wait()`, so the FAT on disk does not change during the load.
+   If the load fails, `failed` is set: entries past `loaded` keep being read
+   from disk, and changes to the FAT fail with -EIO. */
+typedef struct {
+    cluster_t* entries;        // FAT entries, indexed by cluster number
+    size_t nentries;           // Number of entries that fit in one FAT table
+    uint64_t* free_map;        // Bit `c` is set if cluster `c` is free
+    size_t limit;              // One past the last data cluster
+    size_t nfree;              // Number of free clusters
+    size_t reserved;           // Free clusters promised to delayed appends, see `file_buffer_append()`
+    size_t rotor;              // Next-fit: where the next allocation starts looking
+    uint64_t* dirty;           // Bit `s` is set if FAT sector `s` was changed but not written
+    size_t loaded;             // Entries copied from disk so far
+    bool complete;             // Everything is loaded, accessed with atomics
+    bool failed;               // The load stopped on an error, accessed with atomics
+} FatCache;
+
+FatCache fat_cache;
+pthread_rwlock_t fat_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+#define FAT_LOAD_CHUNK 64       // FAT sectors copied per step of the background load
+pthread_t fat_loader;
+bool fat_loader_started;
+pthread_mutex_t fat_load_lock = PTHREAD_MUTEX_INITIALIZER;     // With `fat_load_cond`, signals `complete` or `failed`
+pthread_cond_t fat_load_cond = PTHREAD_COND_INITIALIZER;
+
+char* zero_cluster;     // A cluster worth of zeros, allocated at mount
 
-    // ================== Your code here =================
-    
-    //Modified 1
-    // 计算FAT表项所在的扇区
-    sector_t fat_sector = meta.fat_sec + (clus * 2) / meta.sector_size;
-    // 计算FAT表项在扇区内的偏移量
-    size_t fat_offset = (clus * 2) % meta.sector_size;
+/**
+ * @brief Allocate `fat_cache` for the FAT table described by `meta`. The
+ *        entries and the free bitmap are filled in by the caller.
+ *
+ * @return <int>: Return 0 on success, -ENOERROR on failure.
+ */
+int fat_cache_alloc() {
+    size_t fat_bytes = (size_t)meta.sec_per_fat * meta.sector_size;
+    fat_cache.entries = malloc(fat_bytes);
+    if(fat_cache.entries == NULL) {
+        return -ENOMEM;
+    }
+    fat_cache.nentries = fat_bytes / sizeof(cluster_t);
+    fat_cache.limit = min(CLUSTER_MIN + meta.clusters, fat_cache.nentries);
+    fat_cache.free_map = calloc((fat_cache.limit + 63) / 64, sizeof(uint64_t));
+    fat_cache.dirty = calloc((meta.sec_per_fat + 63) / 64, sizeof(uint64_t));
+    if(fat_cache.free_map == NULL || fat_cache.dirty == NULL) {
+        return -ENOMEM;
+    }
+    fat_cache.nfree = 0;
+    fat_cache.reserved = 0;
+    fat_cache.rotor = CLUSTER_MIN;
+    fat_cache.loaded = fat_cache.nentries;  // Filled in before mount returns, unless loaded lazily
+    fat_cache.complete = true;
+    fat_cache.failed = false;
+    return 0;
+}
 
-    // 读取FAT表项所在的扇区
-    int ret = sector_read(fat_sector, sector_buffer);
-    if (ret < 0) {
-        return CLUSTER_END;
+/**
+ * @brief Mark the free clusters in [`from`, `to`) in the free bitmap. Ranges
+ *        that start and end on a multiple of 64 touch disjoint words, so
+ *        they can be marked by different threads.
+ *
+ * @return <size_t>: The number of free clusters in the range.
+ */
+size_t fat_free_map_build(size_t from, size_t to) {
+    size_t nfree = 0;
+    for(size_t c = max(from, CLUSTER_MIN); c < to; c++) {
+        if(fat_cache.entries[c] == CLUSTER_FREE) {
+            fat_cache.free_map[c / 64] |= 1ull << (c % 64);
+            nfree++;
+        }
     }
+    return nfree;
+}
 
-    // 从扇区缓冲区中提取FAT表项的值
-    cluster_t fat_entry_value;
-    fat_entry_value = 
-        sector_buffer[fat_offset];
-    
-    
-    // ===================================================
-    return *((cluster_t*)&sector_buffer[fat_offset]);    // TODO: Remember to delete or modify this line.
+/**
+ * @brief Load the whole first FAT table into `fat_cache`. Called once at mount.
+ *
+ * @return <int>: Return 0 on success, -ENOERROR on failure.
+ */
+int fat_cache_load() {
+    int ret = fat_cache_alloc();
+    if(ret < 0) {
+        return ret;
+    }
+    ret = sectors_read(meta.fat_sec, meta.sec_per_fat, fat_cache.entries);
+    if(ret < 0) {
+        return ret;
+    }
+    fat_cache.nfree = fat_free_map_build(CLUSTER_MIN, fat_cache.limit);
+    return 0;
+}
+
+/**
+ * @brief Wait until the FAT cache is completely loaded, see `fat_load_main()`.
+ *
+ * @return <int>: Return 0 once it is complete, -EIO if the load failed.
+ */
+int fat_cache_wait() {
+    if(__atomic_load_n(&fat_cache.complete, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    pthread_mutex_lock(&fat_load_lock);
+    while(!__atomic_load_n(&fat_cache.complete, __ATOMIC_ACQUIRE) && !__atomic_load_n(&fat_cache.failed, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&fat_load_cond, &fat_load_lock);
+    }
+    pthread_mutex_unlock(&fat_load_lock);
+    return __atomic_load_n(&fat_cache.complete, __ATOMIC_ACQUIRE) ? 0 : -EIO;
+}
+
+/**
+ * @brief Take `fat_lock` exclusively, once the FAT cache is complete.
+ *
+ * @return <int>: Return 0 with the lock taken, -EIO if the FAT cache could
+ *                not be loaded (the lock is not taken).
+ */
+int fat_write_lock() {
+    int ret = fat_cache_wait();
+    if(ret < 0) {
+        return ret;
+    }
+    pthread_rwlock_wrlock(&fat_lock);
+    return 0;
+}
+
+/**
+ * @brief Find the first cluster at or after `from` (and before `to`) that is
+ *        free if `free` is set, or in use if not.
+ *
+ * @return <size_t>: The cluster number, `to` if there is none.
+ */
+size_t fat_free_map_next(size_t from, size_t to, bool free) {
+    while(from < to) {
+        uint64_t word = fat_cache.free_map[from / 64];
+        word = (free ? word : ~word) >> (from % 64);
+        if(word != 0) {
+            return min(to, from + __builtin_ctzll(word));
+        }
+        from = (from / 64 + 1) * 64;
+    }
+    return to;
+}
+
+/**
+ * @brief Find the first dirty FAT sector at or after `from`.
+ *
+ * @return <size_t>: The FAT sector index, `meta.sec_per_fat` if there is none.
+ */
+size_t fat_dirty_next(size_t from) {
+    while(from < meta.sec_per_fat) {
+        uint64_t word = fat_cache.dirty[from / 64] >> (from % 64);
+        if(word != 0) {
+            return min(meta.sec_per_fat, from + __builtin_ctzll(word));
+        }
+        from = (from / 64 + 1) * 64;
+    }
+    return meta.sec_per_fat;
+}
+
+/**
+ * @brief Write every FAT sector changed in `fat_cache` back to every FAT
+ *        table in the file system, in ascending order and with one request
+ *        per run of consecutive dirty sectors. Caller holds `fat_lock` exclusively.
+ *
+ * @return <int>: Return 0 on success, -ENOERROR on failure.
+ */
+int fat_cache_flush() {
+    size_t s = fat_dirty_next(0);
+    while(s < meta.sec_per_fat) {
+        size_t e = s + 1;
+        while(e < meta.sec_per_fat && (fat_cache.dirty[e / 64] >> (e % 64) & 1)) {
+            e++;
+        }
+        const char* sectors = (const char*)fat_cache.entries + s * meta.sector_size;
+        for(size_t i = 0; i < meta.fats; i++) {
+            int ret = sectors_write(meta.fat_sec + i * meta.sec_per_fat + s, e - s, sectors);
+            if(ret < 0) {
+                return ret;
+            }
+        }
+        for(size_t i = s; i < e; i++) {
+            fat_cache.dirty[i / 64] &= ~(1ull << (i % 64));
+        }
+        s = fat_dirty_next(e);
+    }
+    return 0;
+}
+
+/**
+ * @brief Read the FAT table entry of cluster `clus` from the in-memory FAT,
+ *        or from disk while that part of the FAT is not loaded yet.
+ *
+ * @param clus        : Cluster number
+ * @return <cluster_t>: The next cluster number in the chain, `CLUSTER_END` if
+ *                      `clus` is outside the FAT.
+ */
+cluster_t read_fat_entry(cluster_t clus)
+{
+    if(clus >= fat_cache.nentries) {
+        return CLUSTER_END;
+    }
+    pthread_rwlock_rdlock(&fat_lock);
+    bool cached = clus < fat_cache.loaded;
+    cluster_t next = cached ? fat_cache.entries[clus] : CLUSTER_END;
+    pthread_rwlock_unlock(&fat_lock);
+    if(!cached) {
+        char sector_buffer[MAX_LOGICAL_SECTOR_SIZE];
+        size_t byte = (size_t)clus * sizeof(cluster_t);
+        if(sector_read(meta.fat_sec + byte / meta.sector_size, sector_buffer) < 0) {
+            return CLUSTER_END;
+        }
+        memcpy(&next, sector_buffer + byte % meta.sector_size, sizeof(cluster_t));
+    }
+    return next;
 }
 
 typedef struct {
     DIR_ENTRY dir;
     sector_t sector;
     size_t offset;
+    cluster_t parent;       // First cluster of the directory holding the entry, CLUSTER_FREE for the root
 } DirEntrySlot;
 
 /**
- * @brief Find a directory entry, starting from the name for the first len bytes to search for the file/directory name
+ * @brief Hash the location of a directory entry to a number of `bits` bits.
+ *        The entry number is spread with Fibonacci hashing, so that entries at
+ *        the same offset of different sectors land in different slots.
+ */
+size_t entry_location_hash(sector_t sector, size_t offset, unsigned bits) {
+    uint64_t key = (uint64_t)sector * (MAX_LOGICAL_SECTOR_SIZE / DIR_ENTRY_SIZE) + offset / DIR_ENTRY_SIZE;
+    return (key * 0x9E3779B97F4A7C15ull) >> (64 - bits);
+}
+
+#define DIR_SCAN_SIZE (4 * MAX_LOGICAL_SECTOR_SIZE)     // Bytes of directory sectors fetched per disk request
+
+/* In-memory index of a directory: a hash table from the 11-byte short name of
+   every entry to its position in the directory, plus the positions where a
+   new entry can go. It is built by scanning the directory the first time the
+   directory is searched and kept in sync by `dir_entry_write()`, so a name
+   lookup is one hash probe and one sector read instead of a scan. Positions
+   count directory entries from the start of the directory. The root has its
+   own index, `root_index`, which is never evicted. The other directories are
+   cached in a set-associative table: the first cluster of a directory is
+   hashed to one of DIR_INDEX_SETS sets, and the least recently used of its
+   DIR_INDEX_WAYS indexes makes room for a new one. `root_index_lock` and the
+   per-set `dir_index_locks` are held while an index is used and while an
+   entry of a directory covered by the lock is rewritten. */
+#define DIR_INDEX_SET_BITS 4
+#define DIR_INDEX_SETS (1 << DIR_INDEX_SET_BITS)
+#define DIR_INDEX_WAYS 4
+#define DIR_INDEX_MIN_BUCKETS 64
+
+typedef struct {
+    char name[FAT_NAME_LEN];
+    uint32_t pos;               // Position + 1 of the entry, 0 if the bucket is empty
+} DirIndexBucket;
+
+typedef struct {
+    bool valid;
+    cluster_t first;            // First cluster of the directory, CLUSTER_FREE for the root
+    cluster_t* clusters;        // Cluster chain of the directory, unused for the root
+    size_t nclusters;
+    size_t capacity;            // Number of entries the directory can hold
+    size_t end;                 // Position of the first never-used entry
+    DirIndexBucket* buckets;    // Open addressing with linear probing
+    size_t nbuckets;            // A power of 2
+    size_t nnames;
+    uint32_t* deleted;          // Positions of deleted entries, reused first
+    size_t ndeleted;
+    size_t deleted_capacity;
+    uint64_t last_used;         // Value of the set's clock at the last use, for LRU
+} DirIndex;
+
+DirIndex root_index;
+pthread_mutex_t root_index_lock = PTHREAD_MUTEX_INITIALIZER;
+DirIndex dir_index[DIR_INDEX_SETS][DIR_INDEX_WAYS];
+pthread_mutex_t dir_index_locks[DIR_INDEX_SETS];
+uint64_t dir_index_clock[DIR_INDEX_SETS];      // Protected by the lock of the set
+
+size_t dir_index_set(cluster_t first) {
+    return ((uint32_t)first * 2654435761u) >> (32 - DIR_INDEX_SET_BITS);   // Fibonacci hashing
+}
+
+pthread_mutex_t* dir_index_lock(cluster_t first) {
+    if(first == CLUSTER_FREE) {
+        return &root_index_lock;
+    }
+    return &dir_index_locks[dir_index_set(first)];
+}
+
+/**
+ * @brief The cached index of the directory starting at cluster `first`, or
+ *        NULL if there is none. Caller holds `dir_index_lock(first)`.
+ */
+DirIndex* dir_index_find(cluster_t first) {
+    if(first == CLUSTER_FREE) {
+        return root_index.valid ? &root_index : NULL;
+    }
+    DirIndex* set = dir_index[dir_index_set(first)];
+    for(size_t i = 0; i < DIR_INDEX_WAYS; i++) {
+        if(set[i].valid && set[i].first == first) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
+
+void dir_index_free(DirIndex* idx) {
+    free(idx->clusters);
+    free(idx->buckets);
+    free(idx->deleted);
+    memset(idx, 0, sizeof(DirIndex));
+}
+
+/**
+ * @brief Drop the index of the directory starting at cluster `first`, if any.
+ */
+void dir_index_drop(cluster_t first) {
+    pthread_mutex_lock(dir_index_lock(first));
+    DirIndex* idx = dir_index_find(first);
+    if(idx != NULL) {
+        dir_index_free(idx);
+    }
+    pthread_mutex_unlock(dir_index_lock(first));
+}
+
+size_t dir_index_hash(const char* name) {
+    uint64_t h = 0xcbf29ce484222325ull;     // FNV-1a
+    for(size_t i = 0; i < FAT_NAME_LEN; i++) {
+        h = (h ^ (uint8_t)name[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+/**
+ * @brief Find the bucket holding `name`, or the empty bucket where it would go.
+ */
+DirIndexBucket* dir_index_bucket(DirIndex* idx, const char* name) {
+    size_t mask = idx->nbuckets - 1;
+    for(size_t i = dir_index_hash(name) & mask; ; i = (i + 1) & mask) {
+        DirIndexBucket* b = &idx->buckets[i];
+        if(b->pos == 0 || memcmp(b->name, name, FAT_NAME_LEN) == 0) {
+            return b;
+        }
+    }
+}
+
+int dir_index_insert(DirIndex* idx, const char* name, size_t pos) {
+    if((idx->nnames + 1) * 2 > idx->nbuckets) {     // Keep the load factor at most 1/2
+        size_t old_nbuckets = idx->nbuckets;
+        DirIndexBucket* old = idx->buckets;
+        size_t nbuckets = max(DIR_INDEX_MIN_BUCKETS, old_nbuckets * 2);
+        DirIndexBucket* buckets = calloc(nbuckets, sizeof(DirIndexBucket));
+        if(buckets == NULL) {
+            return -ENOMEM;
+        }
+        idx->buckets = buckets;
+        idx->nbuckets = nbuckets;
+        for(size_t i = 0; i < old_nbuckets; i++) {
+            if(old[i].pos != 0) {
+                *dir_index_bucket(idx, old[i].name) = old[i];
+            }
+        }
+        free(old);
+    }
+    DirIndexBucket* b = dir_index_bucket(idx, name);
+    if(b->pos == 0) {
+        idx->nnames++;
+    }
+    memcpy(b->name, name, FAT_NAME_LEN);
+    b->pos = pos + 1;
+    return 0;
+}
+
+void dir_index_remove(DirIndex* idx, const char* name, size_t pos) {
+    if(idx->nnames == 0) {
+        return;
+    }
+    DirIndexBucket* b = dir_index_bucket(idx, name);
+    if(b->pos != pos + 1) {
+        return;
+    }
+    // Backward-shift deletion: move later entries of the probe run into the hole
+    size_t mask = idx->nbuckets - 1;
+    size_t hole = b - idx->buckets;
+    for(size_t i = (hole + 1) & mask; idx->buckets[i].pos != 0; i = (i + 1) & mask) {
+        size_t home = dir_index_hash(idx->buckets[i].name) & mask;
+        if(((i - home) & mask) >= ((i - hole) & mask)) {
+            idx->buckets[hole] = idx->buckets[i];
+            hole = i;
+        }
+    }
+    idx->buckets[hole].pos = 0;
+    idx->nnames--;
+}
+
+int dir_index_add_deleted(DirIndex* idx, size_t pos) {
+    if(idx->ndeleted == idx->deleted_capacity) {
+        size_t capacity = max(16, idx->deleted_capacity * 2);
+        uint32_t* deleted = realloc(idx->deleted, capacity * sizeof(uint32_t));
+        if(deleted == NULL) {
+            return -ENOMEM;
+        }
+        idx->deleted = deleted;
+        idx->deleted_capacity = capacity;
+    }
+    idx->deleted[idx->ndeleted++] = pos;
+    return 0;
+}
+
+void dir_index_remove_deleted(DirIndex* idx, size_t pos) {
+    for(size_t i = idx->ndeleted; i > 0; i--) {     // Usually the last one, see `find_entry_in_dir()`
+        if(idx->deleted[i - 1] == pos) {
+            idx->deleted[i - 1] = idx->deleted[--idx->ndeleted];
+            return;
+        }
+    }
+}
+
+int dir_index_add_cluster(DirIndex* idx, cluster_t clus) {
+    if((idx->nclusters & (idx->nclusters - 1)) == 0) {     // Grow at powers of 2
+        cluster_t* clusters = realloc(idx->clusters, max(1, idx->nclusters * 2) * sizeof(cluster_t));
+        if(clusters == NULL) {
+            return -ENOMEM;
+        }
+        idx->clusters = clusters;
+    }
+    idx->clusters[idx->nclusters++] = clus;
+    idx->capacity += meta.cluster_size / DIR_ENTRY_SIZE;
+    return 0;
+}
+
+/**
+ * @brief Fill in the location of the entry at position `pos` of the directory.
+ */
+void dir_index_locate(DirIndex* idx, size_t pos, DirEntrySlot* slot) {
+    size_t byte = pos * DIR_ENTRY_SIZE;
+    if(idx->first == CLUSTER_FREE) {
+        slot->sector = meta.root_sec + byte / meta.sector_size;
+    } else {
+        size_t per_clus = meta.cluster_size / DIR_ENTRY_SIZE;
+        byte = (pos % per_clus) * DIR_ENTRY_SIZE;
+        slot->sector = cluster_first_sector(idx->clusters[pos / per_clus]) + byte / meta.sector_size;
+    }
+    slot->offset = byte % meta.sector_size;
+    slot->parent = idx->first;
+}
+
+/**
+ * @brief Find the position of the entry stored at the location of `slot`.
  * 
- * @param name  : Pointer to the filename (not necessarily NULL-terminated, hence the `len` parameter is needed)
- * @param len   : Length of the filename
- * @param from_sector : Starting sector to search
- * @param sectors_count : Number of sectors to search
- * @param slot  : Output parameter to store the directory entry and its location (if found)
- * @return <int>: Returns FIND_EXIST if an entry is found; FIND_EMPTY when an empty slot is found; FIND_FULL if all sectors are full (sets errno to negative)
+ * @return <int>: Return 0 on success, -ENOENT if it is not in the directory.
  */
-int find_entry_in_sectors(const char* name, size_t len, 
-            sector_t from_sector, size_t sectors_count, 
-            DirEntrySlot* slot) {
-    char buffer[MAX_LOGICAL_SECTOR_SIZE];
+int dir_index_position(DirIndex* idx, const DirEntrySlot* slot, size_t* pos) {
+    size_t in_sector = slot->offset / DIR_ENTRY_SIZE;
+    size_t per_sec = meta.sector_size / DIR_ENTRY_SIZE;
+    if(idx->first == CLUSTER_FREE) {
+        if(slot->sector < meta.root_sec || slot->sector >= meta.root_sec + meta.root_sectors) {
+            return -ENOENT;
+        }
+        *pos = (slot->sector - meta.root_sec) * per_sec + in_sector;
+        return 0;
+    }
+    cluster_t clus = sector_cluster(slot->sector);
+    for(size_t i = idx->nclusters; i > 0; i--) {    // New entries usually go into the last cluster
+        if(idx->clusters[i - 1] == clus) {
+            size_t sec_in_clus = slot->sector - cluster_first_sector(clus);
+            *pos = (i - 1) * meta.sec_per_clus * per_sec + sec_in_clus * per_sec + in_sector;
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
 
-    /**
-     * TASK 2.1
-     * TODO:
-     *   Find a *directory entry* with the filename to be `name` in the
-     *   specified sectors (the `sectors_count` sectors starting from `from_sector`)
-     * 
-     * Hint:
-     *   You can refer to the implementation of `fill_entries_in_sectors`. They
-     *   are quite similar. The difference is, you need to find the corresponding
-     *   directory entry and assign values to `slot`, then return the correct 
-     *   value instead of calling the `filler()` function.
-     *   You can use the `check_name()` function to check if the directory entry 
-     *   matches the filename you are looking for (`name`)
-     *   
-     * Note:
-     *   - Return `FIND_EXIST` when an entry is found;
-     *   - Return `FIND_EMPTY` when an empty slot is found;
-     *   - Return `FIND_FULL` when all sectors are full.
-     */
-    // ================== Your code here =================
-    //Modified 1
-    for(sector_t sec = from_sector;sec < from_sector + sectors_count;++sec){
+/**
+ * @brief Index the `size` bytes of directory entries in `buffer`, which are
+ *        the entries from position `*pos` on.
+ * 
+ * @return <int>: Return 1 if the end of the directory was found, 0 if not,
+ *                -ENOERROR on failure.
+ */
+int dir_index_scan_entries(DirIndex* idx, const char* buffer, size_t size, size_t* pos) {
+    for(size_t off = 0; off < size; off += DIR_ENTRY_SIZE, (*pos)++) {
+        DIR_ENTRY* entry = (DIR_ENTRY*)(buffer + off);
+        int ret = 0;
+        if(de_is_free(entry)) {         // No more entries after a free one
+            idx->end = *pos;
+            return 1;
+        }
+        if(de_is_valid(entry)) {
+            ret = dir_index_insert(idx, (const char*)entry->DIR_Name, *pos);
+        } else if(de_is_deleted(entry)) {
+            ret = dir_index_add_deleted(idx, *pos);
+        }
+        if(ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
 
-    int ret = sector_read(sec,buffer);
-    if(ret < 0) {
+/**
+ * @brief Index the `nsec` directory sectors starting at `first_sec`, which
+ *        hold the entries from position `*pos` on.
+ * 
+ * @return <int>: Return 1 if the end of the directory was found, 0 if not,
+ *                -ENOERROR on failure.
+ */
+int dir_index_scan(DirIndex* idx, sector_t first_sec, size_t nsec, size_t* pos) {
+    char buffer[DIR_SCAN_SIZE];
+    size_t batch = DIR_SCAN_SIZE / meta.sector_size;   // Sectors read per request
+    for(size_t i = 0; i < nsec; i += batch) {
+        size_t n = min(batch, nsec - i);
+        int ret = sectors_read(first_sec + i, n, buffer);
+        if(ret < 0) {
             return -EIO;
+        }
+        ret = dir_index_scan_entries(idx, buffer, n * meta.sector_size, pos);
+        if(ret != 0) {
+            return ret;
+        }
     }
-    
-    for(size_t off = 0; off < meta.sector_size ; off += DIR_ENTRY_SIZE )
-    {
-        DIR_ENTRY* entry = (DIR_ENTRY*)(buffer + off);
-        if(de_is_free(entry)){
-            slot->dir = *entry;
-            slot->offset = off;
-            slot->sector = sec;
-            return FIND_EMPTY;
-        }
-        if(check_name(name,len,entry)){
-            slot->dir = *entry;
-            slot->offset = off;
-            slot->sector = sec;
-            return FIND_EXIST;
+    return 0;
+}
+
+/**
+ * @brief Build the index of the directory starting at cluster `first`.
+ * 
+ * @return <int>: Return 0 on success, -ENOERROR on failure.
+ */
+int dir_index_build(DirIndex* idx, cluster_t first) {
+    idx->first = first;
+    int ret = 0;
+    size_t pos = 0;
+    if(first == CLUSTER_FREE) {
+        idx->capacity = meta.dir_entries;
+        ret = dir_index_scan(idx, meta.root_sec, meta.root_sectors, &pos);
+    } else {
+        for(cluster_t clus = first; is_cluster_inuse(clus); clus = read_fat_entry(clus)) {
+            if(idx->nclusters > meta.clusters) {    // The chain loops
+                return -EUCLEAN;
+            }
+            ret = dir_index_add_cluster(idx, clus);
+            if(ret < 0) {
+                return ret;
+            }
+        }
+        for(size_t i = 0; i < idx->nclusters && ret == 0; i++) {
+            ret = dir_index_scan(idx, cluster_first_sector(idx->clusters[i]), meta.sec_per_clus, &pos);
+        }
+    }
+    if(ret < 0) {
+        return ret;
+    }
+    if(ret == 0) {      // Every entry is in use
+        idx->end = idx->capacity;
+    }
+    idx->valid = true;
+    return 0;
+}
+
+/**
+ * @brief Get the index of the directory starting at cluster `first`,
+ *        building it if it is not cached. Caller holds `dir_index_lock(first)`.
+ * 
+ * @return <int>: Return 0 on success, -ENOERROR on failure.
+ */
+int dir_index_get(cluster_t first, DirIndex** out) {
+    DirIndex* idx = dir_index_find(first);
+    if(idx == NULL) {
+        if(first == CLUSTER_FREE) {
+            idx = &root_index;
+        } else {                // Take a free way of the set, or the least recently used one
+            DirIndex* set = dir_index[dir_index_set(first)];
+            idx = &set[0];
+            for(size_t i = 1; i < DIR_INDEX_WAYS && idx->valid; i++) {
+                if(!set[i].valid || set[i].last_used < idx->last_used) {
+                    idx = &set[i];
+                }
+            }
+        }
+        dir_index_free(idx);
+        int ret = dir_index_build(idx, first);
+        if(ret < 0) {
+            dir_index_free(idx);
+            return ret;
+        }
+    }
+    if(first != CLUSTER_FREE) {
+        idx->last_used = ++dir_index_clock[dir_index_set(first)];
+    }
+    *out = idx;
+    return 0;
+}
+
+/**
+ * @brief Bring the index of the directory holding `slot` up to date after
+ *        the entry `old` stored there has been overwritten with `slot->dir`.
+ *        Caller holds `dir_index_lock(slot->parent)`.
+ */
+void dir_index_update(const DirEntrySlot* slot, const DIR_ENTRY* old) {
+    DirIndex* idx = dir_index_find(slot->parent);
+    size_t pos;
+    if(idx == NULL || dir_index_position(idx, slot, &pos) < 0) {
+        return;
+    }
+    DIR_ENTRY* dir = (DIR_ENTRY*)&slot->dir;
+    if(de_is_valid((DIR_ENTRY*)old)) {
+        dir_index_remove(idx, (const char*)old->DIR_Name, pos);
+    } else if(pos < idx->end) {
+        dir_index_remove_deleted(idx, pos);
+    }
+    if(pos >= idx->end && !de_is_free(dir)) {
+        idx->end = pos + 1;
+    }
+
+    int ret = 0;
+    if(de_is_free(dir) && pos < idx->end) {     // Would hide the entries after it; rebuild later
+        dir_index_free(idx);
+    } else if(de_is_valid(dir)) {
+        ret = dir_index_insert(idx, (const char*)dir->DIR_Name, pos);
+    } else if(de_is_deleted(dir)) {
+        ret = dir_index_add_deleted(idx, pos);
+    }
+    if(ret < 0) {
+        dir_index_free(idx);
+    }
+}
+
+/**
+ * @brief The body of `find_entry_in_dir()`. Caller holds `dir_index_lock(first)`.
+ */
+int dir_index_lookup(const char* name, size_t len, cluster_t first, DirEntrySlot* slot) {
+    DirIndex* idx;
+    int ret = dir_index_get(first, &idx);
+    if(ret < 0) {
+        return ret;
+    }
+    slot->parent = first;
+
+    char shortname[FAT_NAME_LEN];
+    size_t pos;
+    int state = FIND_EMPTY;
+    DirIndexBucket* b = NULL;
+    if(idx->nnames > 0 && to_shortname(name, len, shortname) == 0) {   // An invalid name cannot exist
+        b = dir_index_bucket(idx, shortname);
+    }
+    if(b != NULL && b->pos != 0) {
+        pos = b->pos - 1;
+        state = FIND_EXIST;
+    } else if(idx->ndeleted > 0) {
+        pos = idx->deleted[idx->ndeleted - 1];
+    } else if(idx->end < idx->capacity) {
+        pos = idx->end;
+    } else {
+        return FIND_FULL;
+    }
+
+    char sector_buffer[MAX_LOGICAL_SECTOR_SIZE];
+    dir_index_locate(idx, pos, slot);
+    ret = sector_read(slot->sector, sector_buffer);
+    if(ret < 0) {
+        return ret;
+    }
+    memcpy(&slot->dir, sector_buffer + slot->offset, sizeof(DIR_ENTRY));
+    return state;
+}
+
+/**
+ * @brief Find the entry named by the first `len` bytes of `name` in the
+ *        directory starting at cluster `first`, or an empty slot if there is
+ *        no such entry.
+ * 
+ * @param name  : Pointer to the filename (not necessarily NULL-terminated)
+ * @param len   : Length of the filename
+ * @param first : First cluster of the directory, CLUSTER_FREE for the root
+ * @param slot  : Output parameter to store the directory entry and its location
+ * @return <int>: Returns FIND_EXIST if an entry is found; FIND_EMPTY when an empty slot is found; FIND_FULL if the directory is full; -ENOERROR on failure
+ */
+int find_entry_in_dir(const char* name, size_t len, cluster_t first, DirEntrySlot* slot) {
+    pthread_mutex_lock(dir_index_lock(first));
+    int ret = dir_index_lookup(name, len, first, slot);
+    pthread_mutex_unlock(dir_index_lock(first));
+    return ret;
+}
+
+
+/**
+ * @brief Find the directory entry for the specified path. If the last path segment does not exist, find an empty slot to create the last segment file/directory.
+ * 
+ * @param path    : The path to search
+ * @param slot    : Output parameter to store the directory entry and its location (if found)
+ * @param remains : Output parameter, points to the unlocated part of the `path`. For example, if the path is "a/b/c", and "a" exists but "b" does not, then `remains` will point to "b/c".
+ * @return <int>  :  Returns FIND_EXIST if an entry is found; FIND_EMPTY when an empty slot is found; FIND_FULL if all sectors are full (sets errno to negative)
+ */
+int find_entry_internal(const char* path, DirEntrySlot* slot, const char** remains) {
+    *remains = path;
+    *remains += strspn(*remains, "/");    // Skip the leading '/'
+    
+    // Root directory
+    size_t len = strcspn(*remains, "/"); // Length of the filename to search for at the current level
+    int state = find_entry_in_dir(*remains, len, CLUSTER_FREE, slot);
+
+    // Locate the start of the next level name
+    const char* next_level = *remains + len;
+    next_level += strspn(next_level, "/");
+
+    // Handling of results and errors from root directory search
+    if(state < 0 || *next_level == '\0') {   // Error, or only one level found, return the result directly
+        return state;
+    }
+    if(state != FIND_EXIST) {   // Not the last level yet, still not found
+        return -ENOENT;
+    }
+    if(!attr_is_directory(slot->dir.DIR_Attr)) { // Not the last level and not a directory
+        return -ENOTDIR;
+    }
+
+    cluster_t clus = slot->dir.DIR_FstClusLO;  // Cluster number of the first cluster of the file
+    *remains = next_level;
+    while (true) {
+        size_t len = strcspn(*remains, "/"); // Length of the filename to search for at the current level
+        /**
+         * TASK 5.1
+         * TODO:
+         *   Search for the directory entry in the path of non-root directories [~3 lines of code]
+         * 
+         * Hint: 
+         *   Complete the code below to search for directory entries in paths
+         *   of non-root directories. You should use a while loop to iterate 
+         *   through the directory entries in the cluster corresponding to the
+         *   current directory.
+         */
+        // ================== Your code here =================
+        //Modified 1
+        state = find_entry_in_dir(*remains, len, clus, slot);
+        
+        // ===================================================
+
+        // At this point, `slot` contains the directory entry for the next level
+
+        const char* next_level = *remains + len;
+        next_level += strspn(next_level, "/");
+
+        if(state < 0 || *next_level == '\0') {   // Error, or it's the last level, then return directly
+            return state;
+        }
+        if(state != FIND_EXIST) {
+            return -ENOENT;
+        }
+        if(!attr_is_directory(slot->dir.DIR_Attr)) {
+            return -ENOTDIR;
+        }
+
+        *remains = next_level;          // `remains` points to the start of the next level name
+        clus = slot->dir.DIR_FstClusLO; // Switch to the next cluster
+    }
+    return -EUCLEAN;
+}
+
+
+/* Cache of `find_entry()` results. A path is keyed by the short names of its
+   components, so names that differ only in case share an entry. An entry
+   either holds the directory entry of an existing file or directory, or
+   records that the last path component does not exist in its (existing)
+   parent directory. The table is direct-mapped; a second table maps the
+   location of each cached directory entry back to its cache slot, so that
+   `dir_entry_write()` can keep cached entries up to date. All of it is
+   protected by `dentry_lock`. Every change to a directory entry bumps
+   `dentry_generation`, and a lookup only caches its result if no change
+   happened while it was walking the path. */
+#define DENTRY_CACHE_BITS 12
+#define DENTRY_CACHE_SLOTS (1 << DENTRY_CACHE_BITS)
+#define DENTRY_KEY_MAX (16 * FAT_NAME_LEN)     // Deeper paths are not cached
+
+typedef struct {
+    bool valid;
+    bool exists;                // false: the path is known not to exist
+    size_t key_len;
+    char key[DENTRY_KEY_MAX];
+    DirEntrySlot slot;          // Directory entry and its location, if `exists`
+} DentryCacheEntry;
+
+DentryCacheEntry dentry_cache[DENTRY_CACHE_SLOTS];
+uint32_t dentry_by_location[DENTRY_CACHE_SLOTS];   // Location hash -> cache slot + 1, 0 if none
+uint64_t dentry_generation;
+pthread_mutex_t dentry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Convert `path` into a dentry cache key.
+ * 
+ * @return <int>: Return 0 on success, -EINVAL if the path cannot be cached.
+ */
+int dentry_key(const char* path, char* key, size_t* key_len) {
+    *key_len = 0;
+    path += strspn(path, "/");
+    while(*path != '\0') {
+        size_t len = strcspn(path, "/");
+        if(*key_len + FAT_NAME_LEN > DENTRY_KEY_MAX || to_shortname(path, len, key + *key_len) < 0) {
+            return -EINVAL;
+        }
+        *key_len += FAT_NAME_LEN;
+        path += len;
+        path += strspn(path, "/");
+    }
+    return 0;
+}
+
+size_t dentry_key_hash(const char* key, size_t key_len) {
+    uint64_t h = 0xcbf29ce484222325ull;     // FNV-1a
+    for(size_t i = 0; i < key_len; i++) {
+        h = (h ^ (uint8_t)key[i]) * 0x100000001b3ull;
+    }
+    return h % DENTRY_CACHE_SLOTS;
+}
+
+size_t dentry_location_hash(sector_t sector, size_t offset) {
+    return entry_location_hash(sector, offset, DENTRY_CACHE_BITS);
+}
+
+void dentry_cache_evict(size_t i) {
+    DentryCacheEntry* e = &dentry_cache[i];
+    if(e->valid && e->exists) {
+        size_t l = dentry_location_hash(e->slot.sector, e->slot.offset);
+        if(dentry_by_location[l] == i + 1) {
+            dentry_by_location[l] = 0;
+        }
+    }
+    e->valid = false;
+}
+
+/**
+ * @brief Remember the result of looking up `key`: `slot` if it exists, NULL if not.
+ *        Caller holds `dentry_lock`.
+ */
+void dentry_cache_insert(const char* key, size_t key_len, const DirEntrySlot* slot) {
+    size_t i = dentry_key_hash(key, key_len);
+    dentry_cache_evict(i);
+    DentryCacheEntry* e = &dentry_cache[i];
+    memcpy(e->key, key, key_len);
+    e->key_len = key_len;
+    e->exists = slot != NULL;
+    if(slot != NULL) {
+        e->slot = *slot;
+        size_t l = dentry_location_hash(slot->sector, slot->offset);
+        if(dentry_by_location[l] != 0) {    // Keep every cached entry reachable by location
+            dentry_cache_evict(dentry_by_location[l] - 1);
+        }
+        dentry_by_location[l] = i + 1;
+    }
+    e->valid = true;
+}
+
+DentryCacheEntry* dentry_cache_lookup(const char* key, size_t key_len) {
+    DentryCacheEntry* e = &dentry_cache[dentry_key_hash(key, key_len)];
+    if(e->valid && e->key_len == key_len && memcmp(e->key, key, key_len) == 0) {
+        return e;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Forget the cached lookup of `path`, and with `subtree` set, of every
+ *        path below it too. Called when `path` is created or removed.
+ */
+void dentry_cache_forget(const char* path, bool subtree) {
+    char key[DENTRY_KEY_MAX];
+    size_t key_len;
+    if(dentry_key(path, key, &key_len) < 0) {
+        return;
+    }
+    pthread_mutex_lock(&dentry_lock);
+    dentry_generation++;
+    if(!subtree) {
+        if(dentry_cache_lookup(key, key_len) != NULL) {
+            dentry_cache_evict(dentry_key_hash(key, key_len));
+        }
+    } else {
+        for(size_t i = 0; i < DENTRY_CACHE_SLOTS; i++) {
+            DentryCacheEntry* e = &dentry_cache[i];
+            if(e->valid && e->key_len >= key_len && memcmp(e->key, key, key_len) == 0) {
+                dentry_cache_evict(i);
+            }
+        }
+    }
+    pthread_mutex_unlock(&dentry_lock);
+}
+
+/**
+ * @brief Bring the cached copy of the directory entry stored at the location
+ *        of `slot` up to date after it has been written.
+ */
+void dentry_cache_update(const DirEntrySlot* slot) {
+    size_t l = dentry_location_hash(slot->sector, slot->offset);
+    pthread_mutex_lock(&dentry_lock);
+    dentry_generation++;
+    if(dentry_by_location[l] != 0) {
+        size_t i = dentry_by_location[l] - 1;
+        DentryCacheEntry* e = &dentry_cache[i];
+        bool same = e->slot.sector == slot->sector && e->slot.offset == slot->offset;
+        if(same && de_is_valid((DIR_ENTRY*)&slot->dir)) {
+            e->slot.dir = slot->dir;
+        } else if(same) {
+            dentry_cache_evict(i);
+        }
+    }
+    pthread_mutex_unlock(&dentry_lock);
+}
+
+void dentry_cache_clear() {
+    pthread_mutex_lock(&dentry_lock);
+    memset(dentry_cache, 0, sizeof(dentry_cache));
+    memset(dentry_by_location, 0, sizeof(dentry_by_location));
+    dentry_generation++;
+    pthread_mutex_unlock(&dentry_lock);
+}
+
+/**
+ * @brief Find the directory entry of `path`, answering from the dentry cache
+ *        when possible. The main body of this function is in
+ *        `find_entry_internal()`.
+ * @param path  : The path to look up
+ * @param slot  : Output parameter, contains the directory entry
+ * @return <int>: Return 0 if the directory entry is found; 
+ *                Return -ENOENT if the file does not exist;
+ *                Return the returned error code of `find_entry_internal()` if negative
+ */
+int find_entry(const char* path, DirEntrySlot* slot) {
+    char key[DENTRY_KEY_MAX];
+    size_t key_len;
+    bool cacheable = dentry_key(path, key, &key_len) == 0 && key_len > 0;
+    uint64_t generation = 0;
+    if(cacheable) {
+        pthread_mutex_lock(&dentry_lock);
+        DentryCacheEntry* e = dentry_cache_lookup(key, key_len);
+        if(e != NULL) {
+            bool exists = e->exists;
+            if(exists) {
+                *slot = e->slot;
+            }
+            pthread_mutex_unlock(&dentry_lock);
+            return exists ? 0 : -ENOENT;
+        }
+        generation = dentry_generation;
+        pthread_mutex_unlock(&dentry_lock);
+    }
+
+    const char* remains = NULL;
+    int ret = find_entry_internal(path, slot, &remains);
+    if(ret < 0) {
+        return ret;
+    }
+    if(cacheable) {
+        pthread_mutex_lock(&dentry_lock);
+        if(generation == dentry_generation) {   // Nothing changed during the walk
+            // Only the last component is missing unless FIND_EXIST
+            dentry_cache_insert(key, key_len, ret == FIND_EXIST ? slot : NULL);
+        }
+        pthread_mutex_unlock(&dentry_lock);
+    }
+    return ret == FIND_EXIST ? 0 : -ENOENT;
+}
+
+int dir_grow(cluster_t first, DirEntrySlot* slot);
+
+/**
+ * @brief Find an empty slot for creating a file/directory corresponding to `path`; Returns error if already exist
+ * 
+ * @param path 
+ * @param slot 
+ * @param last_name 
+ * @return <int>: Return 0 if an empty slot is found;
+ *                Return -EEXIST if file already exists;
+ *                Return -ENOSPC if the root directory or the disk is full.
+ */
+int find_empty_slot(const char* path, DirEntrySlot *slot, const char** last_name) {
+    int ret = find_entry_internal(path, slot, last_name);
+    if(ret < 0) {
+        return ret;
+    }
+    if(ret == FIND_EXIST) { // File already exists
+        return -EEXIST;
+    }
+    if(ret == FIND_FULL) {  // All slots are full
+        if(slot->parent == CLUSTER_FREE) {  // The root directory cannot grow
+            return -ENOSPC;
+        }
+        return dir_grow(slot->parent, slot);
+    }
+    return 0;
+}
+
+mode_t get_mode_from_attr(uint8_t attr) {
+    mode_t mode = 0;
+    mode |= attr_is_readonly(attr) ? S_IRUGO : S_NORMAL;
+    mode |= attr_is_directory(attr) ? S_IFDIR : S_IFREG;
+    return mode;
+}
+
+/* Cached cluster chain of a file, so that the cluster holding any file offset
+   is found with one array lookup instead of a walk along the FAT. A file is
+   identified by the location of its directory entry. Chains are built lazily
+   on first access, kept in a small set-associative table, extended when a
+   write appends clusters and invalidated when the chain is cut or freed. The
+   location is hashed to one of CHAIN_INDEX_SETS sets of CHAIN_INDEX_WAYS
+   chains. Each set has a lock in `file_locks`, which doubles as the lock of
+   the files mapped to the set: it is held while a file is read, written,
+   resized or deleted.
+
+   A slot also holds the file's delayed appends: data written at the end of
+   the file is kept in `wb_data` and only gets clusters, FAT entries and a new
+   `DIR_FileSize` when the buffer is flushed, see `file_buffer_flush()`. The
+   file then logically extends `wb_len` bytes past `DIR_FileSize`. The free
+   clusters the flush will need are held back in `wb_reserved`, counted in
+   `fat_cache.reserved`, so that other allocations cannot take them. A new
+   file takes a way without delayed appends if the set has one, so that two
+   files being appended to do not flush each other. If the buffer of a file
+   has to be written because another file takes its way and that fails, the error is kept in `wb_error` until the file's own
+   fsync, flush or release reports it. */
+typedef struct {
+    bool valid;
+    sector_t sector;            // Location of the directory entry (key)
+    size_t offset;
+    cluster_t first;            // First cluster the chain was built from
+    cluster_t* clusters;        // The chain itself, `nclusters` entries
+    size_t nclusters;
+    size_t capacity;            // Allocated length of `clusters`
+    off_t ra_expect;            // Offset a sequential read continues from
+    size_t ra_window;           // Clusters to read ahead, 0 until reads are sequential
+    size_t ra_next;             // First cluster index not read ahead yet
+    cluster_t parent;           // Directory holding the entry, to write it back on flush
+    char* wb_data;              // Delayed appends, the bytes right after `DIR_FileSize`
+    size_t wb_len;
+    size_t wb_capacity;         // Allocated length of `wb_data`
+    size_t wb_reserved;         // Clusters reserved for the flush, protected by `fat_lock`
+    int wb_error;               // Failed write-out of an evicted buffer, or 0
+    sector_t wb_error_sector;   // Directory entry of the file `wb_error` belongs to
+    size_t wb_error_offset;
+    uint64_t last_used;         // Value of the set's clock at the last use, for LRU
+} ChainIndex;
+
+#define CHAIN_INDEX_SET_BITS 6
+#define CHAIN_INDEX_SETS (1 << CHAIN_INDEX_SET_BITS)
+#define CHAIN_INDEX_WAYS 2
+#define READAHEAD_MIN 2                 // Clusters read ahead once reads turn sequential
+#define READAHEAD_MAX (1024 * 1024)     // Largest read-ahead window in bytes
+#define WRITE_BUFFER_MAX (1024 * 1024)          // Delayed appends per file before they are flushed
+#define WRITE_BUFFER_TOTAL (16 * 1024 * 1024)   // Delayed appends of all files together
+ChainIndex chain_index[CHAIN_INDEX_SETS][CHAIN_INDEX_WAYS];
+pthread_mutex_t file_locks[CHAIN_INDEX_SETS];
+uint64_t chain_index_clock[CHAIN_INDEX_SETS];  // Protected by the lock of the set
+size_t write_buffer_total;      // Bytes in all `wb_data` buffers, protected by `write_buffer_lock`
+pthread_mutex_t write_buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int file_buffer_flush(DirEntrySlot* slot, ChainIndex* chain);
+void file_buffer_discard(ChainIndex* chain);
+
+size_t chain_index_set(const DirEntrySlot* slot) {
+    return entry_location_hash(slot->sector, slot->offset, CHAIN_INDEX_SET_BITS);
+}
+
+/**
+ * @brief Lock stripe of the file whose directory entry is `slot`. It is the
+ *        lock of the file's chain index set, hashed from the full location.
+ */
+pthread_mutex_t* file_lock_of(const DirEntrySlot* slot) {
+    return &file_locks[chain_index_set(slot)];
+}
+
+/**
+ * @brief The way of the chain index holding the file whose directory entry is
+ *        `slot`, if it is valid or still holds delayed appends, or NULL.
+ *        Caller holds the file lock.
+ */
+ChainIndex* chain_index_find(const DirEntrySlot* slot) {
+    ChainIndex* set = chain_index[chain_index_set(slot)];
+    for(size_t i = 0; i < CHAIN_INDEX_WAYS; i++) {
+        if(set[i].sector == slot->sector && set[i].offset == slot->offset && (set[i].valid || set[i].wb_len > 0)) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief How costly it is to give the way `c` to another file: free ways
+ *        first, then ways without delayed appends, which need no flush.
+ */
+int chain_index_evict_cost(const ChainIndex* c) {
+    if(c->wb_len > 0) {
+        return 2;
+    }
+    return c->valid ? 1 : 0;
+}
+
+/**
+ * @brief Append the chain starting at `clus` to the cached chain `chain`.
+ * 
+ * @return <int>: Return 0 on success, -ENOERROR on failure.
+ */
+int chain_index_extend(ChainIndex* chain, cluster_t clus) {
+    while(is_cluster_inuse(clus)) {
+        if(chain->nclusters == chain->capacity) {
+            size_t capacity = max(chain->capacity * 2, 16);
+            cluster_t* clusters = realloc(chain->clusters, capacity * sizeof(cluster_t));
+            if(clusters == NULL) {
+                chain->valid = false;
+                return -ENOMEM;
+            }
+            chain->clusters = clusters;
+            chain->capacity = capacity;
+        }
+        if(chain->nclusters > meta.clusters) {  // Longer than the volume, the chain loops
+            chain->valid = false;
+            return -EUCLEAN;
+        }
+        chain->clusters[chain->nclusters++] = clus;
+        clus = read_fat_entry(clus);
+    }
+    return 0;
+}
+
+/**
+ * @brief Get the cached cluster chain of the file whose directory entry is
+ *        `slot`, building it from the FAT if it is not cached yet.
+ * 
+ * @param slot  : Directory entry of the file
+ * @param chain : Output parameter, the cached chain
+ * @return <int>: Return 0 on success, -ENOERROR on failure.
+ */
+int chain_index_get(const DirEntrySlot* slot, ChainIndex** chain) {
+    size_t s = chain_index_set(slot);
+    cluster_t first = slot->dir.DIR_FstClusLO;
+    ChainIndex* c = chain_index_find(slot);
+    if(c != NULL && c->valid && c->first == first) {
+        c->last_used = ++chain_index_clock[s];
+        *chain = c;
+        return 0;
+    }
+    if(c == NULL) {         // Take the cheapest way to evict, the least recently used one on a tie
+        ChainIndex* set = chain_index[s];
+        c = &set[0];
+        for(size_t i = 1; i < CHAIN_INDEX_WAYS; i++) {
+            int cost = chain_index_evict_cost(&set[i]);
+            int best = chain_index_evict_cost(c);
+            if(cost < best || (cost == best && set[i].last_used < c->last_used)) {
+                c = &set[i];
+            }
+        }
+    }
+    if(c->wb_len > 0) {     // The way goes to another file, write out the delayed appends of the old one
+        DirEntrySlot old = { .sector = c->sector, .offset = c->offset, .parent = c->parent };
+        char sector_buffer[MAX_LOGICAL_SECTOR_SIZE];
+        int ret = sector_read(old.sector, sector_buffer);
+        if(ret == 0) {
+            memcpy(&old.dir, sector_buffer + old.offset, sizeof(DIR_ENTRY));
+            ret = file_buffer_flush(&old, c);
+        }
+        if(ret < 0) {       // Not the caller's error, the old file reports it
+            c->wb_error = ret;
+            c->wb_error_sector = old.sector;
+            c->wb_error_offset = old.offset;
+            file_buffer_discard(c);
+        }
+    }
+    c->valid = true;
+    c->sector = slot->sector;
+    c->offset = slot->offset;
+    c->first = first;
+    c->nclusters = 0;
+    c->ra_expect = 0;
+    c->ra_window = 0;
+    c->ra_next = 0;
+    c->parent = slot->parent;
+    c->last_used = ++chain_index_clock[s];
+    int ret = chain_index_extend(c, first);
+    if(ret < 0) {
+        return ret;
+    }
+    *chain = c;
+    return 0;
+}
+
+/**
+ * @brief Give the clusters reserved for the delayed appends of `chain` back
+ *        to other allocations.
+ */
+void file_buffer_unreserve(ChainIndex* chain) {
+    if(chain->wb_reserved == 0 || fat_write_lock() < 0) {  // Nothing is reserved unless the cache is complete
+        return;
+    }
+    fat_cache.reserved -= chain->wb_reserved;
+    chain->wb_reserved = 0;
+    pthread_rwlock_unlock(&fat_lock);
+}
+
+/**
+ * @brief Drop the delayed appends of `chain` without writing them.
+ */
+void file_buffer_discard(ChainIndex* chain) {
+    file_buffer_unreserve(chain);
+    pthread_mutex_lock(&write_buffer_lock);
+    write_buffer_total -= chain->wb_len;
+    pthread_mutex_unlock(&write_buffer_lock);
+    free(chain->wb_data);
+    chain->wb_data = NULL;
+    chain->wb_len = 0;
+    chain->wb_capacity = 0;
+}
+
+/**
+ * @brief Take the error of an evicted flush of the delayed appends of the
+ *        file whose directory entry is `slot`, clearing it.
+ * 
+ * @return <int>: Return the error, or 0 if there is none.
+ */
+int chain_index_take_error(const DirEntrySlot* slot) {
+    ChainIndex* set = chain_index[chain_index_set(slot)];
+    for(size_t i = 0; i < CHAIN_INDEX_WAYS; i++) {
+        ChainIndex* c = &set[i];
+        if(c->wb_error != 0 && c->wb_error_sector == slot->sector && c->wb_error_offset == slot->offset) {
+            int ret = c->wb_error;
+            c->wb_error = 0;
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Drop the cached cluster chain of the file whose directory entry is
+ *        `slot`, together with its delayed appends.
+ */
+void chain_index_invalidate(const DirEntrySlot* slot) {
+    ChainIndex* c = chain_index_find(slot);
+    if(c != NULL) {
+        c->valid = false;
+        file_buffer_discard(c);
+    }
+    chain_index_take_error(slot);
+}
+
+/**
+ * @brief Size of the file whose directory entry is `slot`, including its
+ *        delayed appends. Caller holds the file lock.
+ */
+size_t file_size(const DirEntrySlot* slot) {
+    const ChainIndex* c = chain_index_find(slot);
+    size_t size = slot->dir.DIR_FileSize;
+    if(c != NULL && c->valid) {
+        size += c->wb_len;
+    }
+    return size;
+}
+
+/**
+ * @brief Find the directory entry of `path` and lock the file, so that its
+ *        data, size and clusters stay as they are until `file_unlock()`.
+ * 
+ * @param path  : Path of the file
+ * @param slot  : Output parameter, the directory entry as seen under the lock
+ * @return <int>: Return 0 on success (file locked), -ENOERROR on failure.
+ */
+int file_lock(const char* path, DirEntrySlot* slot) {
+    while(true) {
+        int ret = find_entry(path, slot);
+        if(ret < 0) {
+            return ret;
+        }
+        pthread_mutex_t* lock = file_lock_of(slot);
+        pthread_mutex_lock(lock);
+        DirEntrySlot locked;
+        ret = find_entry(path, &locked);    // The entry may have changed before the lock was taken
+        if(ret == 0 && locked.sector == slot->sector && locked.offset == slot->offset) {
+            *slot = locked;
+            return 0;
+        }
+        pthread_mutex_unlock(lock);
+        if(ret < 0) {
+            return ret;
         }
-        
     }
+}
+
+void file_unlock(const DirEntrySlot* slot) {
+    pthread_mutex_unlock(file_lock_of(slot));
+}
+
+/* An open file, stored in `fi->fh` by `fat16_open()`. It remembers where the
+   directory entry lives, so that I/O on the file locks it without resolving
+   the path again. The handles are also linked into `open_files`, by the
+   file lock of the entry, so that `fat16_unlink()` can mark those of the
+   deleted file: a file created later in the same entry, even with the same
+   name, is not reached through them. */
+typedef struct FileHandle {
+    sector_t sector;
+    size_t offset;
+    cluster_t parent;
+    bool unlinked;              // The file was deleted while open
+    struct FileHandle* next;    // Next open handle under the same file lock
+} FileHandle;
+
+FileHandle* open_files[CHAIN_INDEX_SETS];     // Protected by `file_locks`
+
+/**
+ * @brief Mark the open handles of the file whose directory entry is `slot`
+ *        as unlinked. Caller holds the file lock.
+ */
+void handle_unlink(const DirEntrySlot* slot) {
+    for(FileHandle* fh = open_files[chain_index_set(slot)]; fh != NULL; fh = fh->next) {
+        if(fh->sector == slot->sector && fh->offset == slot->offset) {
+            fh->unlinked = true;
+        }
     }
-    // =================================================
-    return FIND_FULL;
 }
 
 /**
- * @brief Find the directory entry for the specified path. If the last path segment does not exist, find an empty slot to create the last segment file/directory.
+ * @brief Lock the file opened as `fi`, or the file at `path` if `fi` holds no
+ *        handle, like `file_lock()`.
  * 
- * @param path    : The path to search
- * @param slot    : Output parameter to store the directory entry and its location (if found)
- * @param remains : Output parameter, points to the unlocated part of the `path`. For example, if the path is "a/b/c", and "a" exists but "b" does not, then `remains` will point to "b/c".
- * @return <int>  :  Returns FIND_EXIST if an entry is found; FIND_EMPTY when an empty slot is found; FIND_FULL if all sectors are full (sets errno to negative)
+ * @param path  : Path of the file
+ * @param fi    : File info passed by FUSE, may be NULL
+ * @param slot  : Output parameter, the directory entry as seen under the lock
+ * @return <int>: Return 0 on success (file locked), -ENOERROR on failure.
  */
-int find_entry_internal(const char* path, DirEntrySlot* slot, const char** remains) {
-    *remains = path;
-    *remains += strspn(*remains, "/");    // Skip the leading '/'
-    
-    // Root directory
-    sector_t first_sec = meta.root_sec;
-    size_t nsec = meta.root_sectors;
-    size_t len = strcspn(*remains, "/"); // Length of the filename to search for at the current level
-    int state = find_entry_in_sectors(*remains, len, first_sec, nsec, slot);
+int handle_lock(const char* path, const struct fuse_file_info* fi, DirEntrySlot* slot) {
+    const FileHandle* fh = fi != NULL ? (const FileHandle*)(uintptr_t)fi->fh : NULL;
+    if(fh == NULL) {
+        return file_lock(path, slot);
+    }
+    slot->sector = fh->sector;
+    slot->offset = fh->offset;
+    slot->parent = fh->parent;
+    pthread_mutex_lock(file_lock_of(slot));
+    if(fh->unlinked) {
+        file_unlock(slot);
+        return -ENOENT;
+    }
+    char sector_buffer[MAX_LOGICAL_SECTOR_SIZE];
+    int ret = sector_read(slot->sector, sector_buffer);
+    if(ret == 0) {
+        memcpy(&slot->dir, sector_buffer + slot->offset, sizeof(DIR_ENTRY));
+    }
+    if(ret < 0) {
+        file_unlock(slot);
+    }
+    return ret;
+}
 
-    // Locate the start of the next level name
-    const char* next_level = *remains + len;
-    next_level += strspn(next_level, "/");
+/* Locks serialising the creation and deletion of entries in a directory,
+   striped by the first cluster of the directory. They are taken before any
+   file lock; a thread holds at most two, taken in stripe order. */
+#define DIR_LOCK_SLOTS 64
+pthread_mutex_t dir_locks[DIR_LOCK_SLOTS];
 
-    // Handling of results and errors from root directory search
-    if(state < 0 || *next_level == '\0') {   // Error, or only one level found, return the result directly
-        return state;
-    }
-    if(state != FIND_EXIST) {   // Not the last level yet, still not found
-        return -ENOENT;
+void dir_lock(cluster_t a, cluster_t b) {
+    size_t i = a % DIR_LOCK_SLOTS, j = b % DIR_LOCK_SLOTS;
+    pthread_mutex_lock(&dir_locks[min(i, j)]);
+    if(i != j) {
+        pthread_mutex_lock(&dir_locks[max(i, j)]);
     }
-    if(!attr_is_directory(slot->dir.DIR_Attr)) { // Not the last level and not a directory
-        return -ENOTDIR;
+}
+
+void dir_unlock(cluster_t a, cluster_t b) {
+    size_t i = a % DIR_LOCK_SLOTS, j = b % DIR_LOCK_SLOTS;
+    if(i != j) {
+        pthread_mutex_unlock(&dir_locks[max(i, j)]);
     }
+    pthread_mutex_unlock(&dir_locks[min(i, j)]);
+}
 
-    cluster_t clus = slot->dir.DIR_FstClusLO;  // Cluster number of the first cluster of the file
-    *remains = next_level;
-    while (true) {
-        size_t len = strcspn(*remains, "/"); // Length of the filename to search for at the current level
-        /**
-         * TASK 5.1
-         * TODO:
-         *   Search for the directory entry in the path of non-root directories [~3 lines of code]
-         * 
-         * Hint: 
-         *   Complete the code below to search for directory entries in paths
-         *   of non-root directories. You should use a while loop to iterate 
-         *   through the directory entries in the cluster corresponding to the
-         *   current directory.
-         */
-        // ================== Your code here =================
-        //Modified 1
-         while (is_cluster_inuse(clus)) {
-            sector_t sector = cluster_first_sector(clus);
-            state = find_entry_in_sectors(*remains, len, sector, meta.sec_per_clus, slot);
-            if (state != FIND_FULL) {
-                break;
-            }
-            clus = read_fat_entry(clus);
+/**
+ * @brief Lock the directory that holds (or would hold) the last component of
+ *        `path` against concurrent entry creation and deletion. With `self`
+ *        set and `path` naming a directory, lock that directory as well.
+ *        Release with `dir_unlock(*parent, *self_clus)`.
+ * 
+ * @param path      : The path to be created or deleted
+ * @param self      : Whether to lock the directory named by `path` too
+ * @param parent    : Output parameter, first cluster of the locked parent
+ * @param self_clus : Output parameter, first cluster of the other locked directory (`*parent` if none)
+ * @return <int>    : Return 0 on success (locked), -ENOERROR on failure.
+ */
+int dir_lock_path(const char* path, bool self, cluster_t* parent, cluster_t* self_clus) {
+    DirEntrySlot slot;
+    const char* remains;
+    int ret = find_entry_internal(path, &slot, &remains);
+    while(ret >= 0) {
+        cluster_t p = slot.parent;
+        bool is_dir = self && ret == FIND_EXIST && attr_is_directory(slot.dir.DIR_Attr);
+        cluster_t c = is_dir ? slot.dir.DIR_FstClusLO : p;
+        dir_lock(p, c);
+        ret = find_entry_internal(path, &slot, &remains);   // Check nothing moved before the lock was taken
+        is_dir = self && ret == FIND_EXIST && attr_is_directory(slot.dir.DIR_Attr);
+        if(ret >= 0 && slot.parent == p && (is_dir ? slot.dir.DIR_FstClusLO : p) == c) {
+            *parent = p;
+            *self_clus = c;
+            return 0;
         }
-        
-        // ===================================================
+        dir_unlock(p, c);
+    }
+    return ret;
+}
 
-        // At this point, `slot` contains the directory entry for the next level
+/* ================ File System Interface Implementation ================= */
 
-        const char* next_level = *remains + len;
-        next_level += strspn(next_level, "/");
+/**
+ * @brief Give up loading the FAT cache after error `err`. The mount stays
+ *        up: entries not loaded are still read from disk, and threads
+ *        waiting in `fat_cache_wait()` are woken to fail their FAT changes.
+ */
+void fat_load_fail(int err) {
+    fprintf(stderr, "Load FAT table failed: %s, %zu of %zu entries loaded\n", strerror(-err), fat_cache.loaded, fat_cache.nentries);
+    pthread_mutex_lock(&fat_load_lock);
+    __atomic_store_n(&fat_cache.failed, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&fat_load_cond);
+    pthread_mutex_unlock(&fat_load_lock);
+}
 
-        if(state < 0 || *next_level == '\0') {   // Error, or it's the last level, then return directly
-            return state;
-        }
-        if(state != FIND_EXIST) {
-            return -ENOENT;
-        }
-        if(!attr_is_directory(slot->dir.DIR_Attr)) {
-            return -ENOTDIR;
+/**
+ * @brief Body of the thread filling the FAT cache after a --lazy mount, a
+ *        chunk at a time, then indexing the root directory. Until it is
+ *        done, requests are served from disk, see `read_fat_entry()`.
+ */
+void* fat_load_main(void* arg) {
+    size_t per_sec = meta.sector_size / sizeof(cluster_t);
+    char* buffer = malloc(FAT_LOAD_CHUNK * meta.sector_size);
+    if(buffer == NULL) {
+        fat_load_fail(-ENOMEM);
+        return NULL;
+    }
+    for(size_t s = 0; s < meta.sec_per_fat; s += FAT_LOAD_CHUNK) {
+        size_t n = min(FAT_LOAD_CHUNK, meta.sec_per_fat - s);
+        int ret = sectors_read(meta.fat_sec + s, n, buffer);    // Without `fat_lock`, lookups go on meanwhile
+        if(ret < 0) {
+            free(buffer);
+            fat_load_fail(ret);
+            return NULL;
         }
+        pthread_rwlock_wrlock(&fat_lock);
+        memcpy((char*)fat_cache.entries + s * meta.sector_size, buffer, n * meta.sector_size);
+        fat_cache.nfree += fat_free_map_build(s * per_sec, min((s + n) * per_sec, fat_cache.limit));
+        fat_cache.loaded = (s + n) * per_sec;
+        pthread_rwlock_unlock(&fat_lock);
+    }
+    free(buffer);
+    pthread_mutex_lock(&fat_load_lock);
+    __atomic_store_n(&fat_cache.complete, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&fat_load_cond);
+    pthread_mutex_unlock(&fat_load_lock);
+
+    DirIndex* idx;
+    pthread_mutex_lock(&root_index_lock);
+    dir_index_get(CLUSTER_FREE, &idx);  // On failure it is built on demand
+    pthread_mutex_unlock(&root_index_lock);
+    return NULL;
+}
 
-        *remains = next_level;          // `remains` points to the start of the next level name
-        clus = slot->dir.DIR_FstClusLO; // Switch to the next cluster
+/**
+ * @brief Start filling the allocated FAT cache in the background, see
+ *        `fat_load_main()`. If no thread can be started, fill it right away.
+ */
+void fat_load_start() {
+    fat_cache.loaded = 0;
+    fat_cache.complete = false;
+    fat_cache.failed = false;
+    fat_loader_started = pthread_create(&fat_loader, NULL, fat_load_main, NULL) == 0;
+    if(!fat_loader_started) {
+        fat_load_main(NULL);
     }
-    return -EUCLEAN;
 }
 
+/* Mount-time pre-scan (--prewarm): the reserved area, every FAT copy and the
+   root directory are read with one sequential request, then the FAT cache,
+   its free bitmap and the root directory index are built from that buffer by
+   worker threads: PREWARM_WORKERS share the bitmap, one indexes the root
+   directory and one checks the FAT copies against the first. */
+#define PREWARM_WORKERS 4
 
-/**
- * @brief Write the directory entry (stored in `slot`) into the file system.
- *        The main body of this function is in `find_entry_internal()`.
- *        You don't need to modify this function.
- * @param path  : The path to write to
- * @param slot  : Contains the directory entry
- * @return <int>: Return 0 if the directory entry is found; 
- *                Return -ENOENT if the file does not exist;
- *                Return the returned error code of `find_entry_internal()` if negative
- */
-int find_entry(const char* path, DirEntrySlot* slot) {
-    const char* remains = NULL;
-    int ret = find_entry_internal(path, slot, &remains);
+typedef struct {
+    pthread_t thread;
+    const char* area;           // Sectors 0 up to the end of the root directory
+    size_t from, to;            // Clusters whose free bits to set
+    size_t nfree;               // Result: free clusters found
+    bool started;               // Runs in its own thread
+} PrewarmTask;
+
+void* prewarm_free_map(void* arg) {
+    PrewarmTask* t = arg;
+    t->nfree = fat_free_map_build(t->from, t->to);
+    return NULL;
+}
+
+void* prewarm_root_index(void* arg) {
+    PrewarmTask* t = arg;
+    DirIndex* idx = &root_index;
+    pthread_mutex_lock(&root_index_lock);
+    dir_index_free(idx);
+    idx->first = CLUSTER_FREE;
+    idx->capacity = meta.dir_entries;
+    size_t pos = 0;
+    const char* root = t->area + (size_t)meta.root_sec * meta.sector_size;
+    int ret = dir_index_scan_entries(idx, root, (size_t)meta.root_sectors * meta.sector_size, &pos);
+    if(ret == 0) {      // Every entry is in use
+        idx->end = idx->capacity;
+    }
     if(ret < 0) {
-        return ret;
+        dir_index_free(idx);    // Built on demand later
+    } else {
+        idx->valid = true;
     }
-    if(ret == FIND_EXIST) {
-        return 0;
+    pthread_mutex_unlock(&root_index_lock);
+    return NULL;
+}
+
+void* prewarm_fat_copies(void* arg) {
+    PrewarmTask* t = arg;
+    size_t fat_bytes = (size_t)meta.sec_per_fat * meta.sector_size;
+    const char* first = t->area + (size_t)meta.fat_sec * meta.sector_size;
+    for(size_t i = 1; i < meta.fats; i++) {
+        if(memcmp(first, first + i * fat_bytes, fat_bytes) != 0) {
+            fprintf(stderr, "Warning: FAT copy %lu differs from the first, which is used\n", i + 1);
+        }
     }
-    return -ENOENT;
+    return NULL;
 }
 
 /**
- * @brief Find an empty slot for creating a file/directory corresponding to `path`; Returns error if already exist
+ * @brief Load the FAT cache and index the root directory up front, instead
+ *        of `fat_cache_load()` and building the index on first use.
  * 
- * @param path 
- * @param slot 
- * @param last_name 
- * @return <int>: Return 0 if an empty slot is found;
- *                Return -EEXIST if file already exists;
- *                Return -ENOSPC if directory already full.
+ * @return <int>: Return 0 on success, -ENOERROR on failure.
  */
-int find_empty_slot(const char* path, DirEntrySlot *slot, const char** last_name) {
-    int ret = find_entry_internal(path, slot, last_name);
+int fat16_prewarm() {
+    size_t nsec = meta.root_sec + meta.root_sectors;
+    char* area = malloc(nsec * meta.sector_size);
+    if(area == NULL) {
+        return -ENOMEM;
+    }
+    int ret = sectors_read(0, nsec, area);
+    if(ret == 0) {
+        ret = fat_cache_alloc();
+    }
     if(ret < 0) {
+        free(area);
         return ret;
     }
-    if(ret == FIND_EXIST) { // File already exists
-        return -EEXIST;
+    memcpy(fat_cache.entries, area + (size_t)meta.fat_sec * meta.sector_size, (size_t)meta.sec_per_fat * meta.sector_size);
+
+    PrewarmTask tasks[PREWARM_WORKERS + 2];
+    memset(tasks, 0, sizeof(tasks));
+    size_t words = (fat_cache.limit + 63) / 64;
+    for(size_t i = 0; i < PREWARM_WORKERS; i++) {   // Split the bitmap at word boundaries
+        tasks[i].from = min(fat_cache.limit, words * i / PREWARM_WORKERS * 64);
+        tasks[i].to = min(fat_cache.limit, words * (i + 1) / PREWARM_WORKERS * 64);
+    }
+    void* (*work[PREWARM_WORKERS + 2])(void*);
+    for(size_t i = 0; i < PREWARM_WORKERS; i++) {
+        work[i] = prewarm_free_map;
+    }
+    work[PREWARM_WORKERS] = prewarm_root_index;
+    work[PREWARM_WORKERS + 1] = prewarm_fat_copies;
+    for(size_t i = 0; i < PREWARM_WORKERS + 2; i++) {
+        tasks[i].area = area;
+        tasks[i].started = pthread_create(&tasks[i].thread, NULL, work[i], &tasks[i]) == 0;
+        if(!tasks[i].started) {
+            work[i](&tasks[i]);         // Do it here instead
+        }
     }
-    if(ret == FIND_FULL) {  // All slots are full
-        return -ENOSPC;
+    for(size_t i = 0; i < PREWARM_WORKERS + 2; i++) {
+        if(tasks[i].started) {
+            pthread_join(tasks[i].thread, NULL);
+        }
+        fat_cache.nfree += tasks[i].nfree;
     }
+    free(area);
     return 0;
 }
 
-mode_t get_mode_from_attr(uint8_t attr) {
-    mode_t mode = 0;
-    mode |= attr_is_readonly(attr) ? S_IRUGO : S_NORMAL;
-    mode |= attr_is_directory(attr) ? S_IFDIR : S_IFREG;
-    return mode;
-}
-
-/* ================ File System Interface Implementation ================= */
-
 /**
- * @brief File system initialization. DO NOT MODIFY!
- *        However, you can read this function to learn how to use `sector_read()`
- *        to read metadata in the file system.
+ * @brief File system initialization. Reads the BPB with `sector_read()` and
+ *        loads the FAT table into memory.
  * 
  * @param conn 
  * @return <void*>
  */
 void *fat16_init(struct fuse_conn_info * conn, struct fuse_config *config) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const FsOptions* opts = fuse_get_context()->private_data;
+    bool prewarm = opts != NULL && opts->prewarm;
+    bool lazy = opts != NULL && opts->lazy && !prewarm;
+    for(size_t i = 0; i < DIR_INDEX_SETS; i++) {
+        pthread_mutex_init(&dir_index_locks[i], NULL);
+    }
+    for(size_t i = 0; i < CHAIN_INDEX_SETS; i++) {
+        pthread_mutex_init(&file_locks[i], NULL);
+    }
+    for(size_t i = 0; i < DIR_LOCK_SLOTS; i++) {
+        pthread_mutex_init(&dir_locks[i], NULL);
+    }
+    // Delete open files right away instead of renaming them to .fuse_hidden*,
+    // which needs rename; their handles notice it, see `handle_lock()`
+    config->hard_remove = 1;
+
     /* Reads the BPB */
     BPB_BS bpb;
     sector_read(0, &bpb);
@@ -321,7 +1677,11 @@ void *fat16_init(struct fuse_conn_info * conn, struct fuse_config *config) {
     meta.dir_entries = bpb.BPB_RootEntCnt;
     meta.sectors = bpb.BPB_TotSec16 != 0 ? bpb.BPB_TotSec16 : bpb.BPB_TotSec32;
     meta.sec_per_fat = bpb.BPB_FATSz16;
-
+    int ret = disk_set_sector_size(meta.sector_size);  // Sector numbers below are logical sectors
+    if(ret < 0) {
+        fprintf(stderr, "Unsupported sector size %u: %s\n", meta.sector_size, strerror(-ret));
+        exit(-ret);
+    }
 
     meta.fat_sec = meta.reserved;
     meta.root_sec = meta.fat_sec + (meta.fats * meta.sec_per_fat);
@@ -333,18 +1693,97 @@ void *fat16_init(struct fuse_conn_info * conn, struct fuse_config *config) {
     meta.fs_uid = getuid();
     meta.fs_gid = getgid();
 
+    if(prewarm) {
+        ret = fat16_prewarm();
+    } else if(lazy) {
+        ret = fat_cache_alloc();        // Filled by `fat_load_start()`
+    } else {
+        ret = fat_cache_load();
+    }
+    if(ret < 0) {
+        fprintf(stderr, "Load FAT table failed: %s\n", strerror(-ret));
+        exit(-ret);
+    }
+    zero_cluster = calloc(1, meta.cluster_size);
+    if(zero_cluster == NULL) {
+        fprintf(stderr, "Allocate zero cluster failed\n");
+        exit(ENOMEM);
+    }
+    disk_start();
+    if(lazy) {
+        fat_load_start();
+    }
+
     struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("mount took %.3f ms%s\n", (now.tv_sec - start.tv_sec) * 1e3 + (now.tv_nsec - start.tv_nsec) / 1e6,
+           prewarm ? " (prewarmed)" : lazy ? " (FAT loading in the background)" : "");
     clock_gettime(CLOCK_REALTIME, &now);
     meta.atime = meta.mtime = meta.ctime = now;
     return NULL;
 }
 
 /**
- * @brief Release file system. DO NOT MODIFY!
+ * @brief Release file system.
  * 
  * @param data 
  */
-void fat16_destroy(void *data) { }
+void fat16_destroy(void *data) {
+    if(fat_loader_started) {
+        pthread_join(fat_loader, NULL);
+        fat_loader_started = false;
+    }
+    for(size_t i = 0; i < CHAIN_INDEX_SETS * CHAIN_INDEX_WAYS; i++) {
+        ChainIndex* c = &chain_index[i / CHAIN_INDEX_WAYS][i % CHAIN_INDEX_WAYS];
+        if(c->wb_len > 0) {
+            DirEntrySlot slot = { .sector = c->sector, .offset = c->offset, .parent = c->parent };
+            char sector_buffer[MAX_LOGICAL_SECTOR_SIZE];
+            if(sector_read(slot.sector, sector_buffer) == 0) {
+                memcpy(&slot.dir, sector_buffer + slot.offset, sizeof(DIR_ENTRY));
+                file_buffer_flush(&slot, c);
+            }
+        }
+    }
+    disk_stop();
+    free(fat_cache.entries);
+    free(fat_cache.free_map);
+    memset(&fat_cache, 0, sizeof(FatCache));
+    free(zero_cluster);
+    zero_cluster = NULL;
+    for(size_t i = 0; i < CHAIN_INDEX_SETS; i++) {
+        for(size_t j = 0; j < CHAIN_INDEX_WAYS; j++) {
+            free(chain_index[i][j].clusters);
+            free(chain_index[i][j].wb_data);
+            memset(&chain_index[i][j], 0, sizeof(ChainIndex));
+        }
+        chain_index_clock[i] = 0;
+    }
+    write_buffer_total = 0;
+    dir_index_free(&root_index);
+    for(size_t i = 0; i < DIR_INDEX_SETS; i++) {
+        for(size_t j = 0; j < DIR_INDEX_WAYS; j++) {
+            dir_index_free(&dir_index[i][j]);
+        }
+        dir_index_clock[i] = 0;
+    }
+}
+
+/**
+ * @brief Fill the attributes of `stbuf` that depend on the file: mode, size,
+ *        blocks and timestamps.
+ * 
+ * @param dir   : Directory entry of the file
+ * @param size  : File size, including delayed appends
+ * @param stbuf : Output parameter, the other attributes are left as they are
+ */
+void entry_stat(const DIR_ENTRY* dir, size_t size, struct stat* stbuf) {
+    stbuf->st_mode = get_mode_from_attr(dir->DIR_Attr);
+    stbuf->st_size = size;
+    stbuf->st_blocks = size / PHYSICAL_SECTOR_SIZE;
+    time_fat_to_unix(&stbuf->st_atim, dir->DIR_LstAccDate, 0, 0);
+    time_fat_to_unix(&stbuf->st_mtim, dir->DIR_WrtDate, dir->DIR_WrtTime, 0);
+    time_fat_to_unix(&stbuf->st_ctim, dir->DIR_CrtDate, dir->DIR_CrtTime, dir->DIR_CrtTimeTenth);
+}
 
 /**
  * @brief Fetch the file attributes corresponding to `path`. DO NOT MODIFY!
@@ -383,151 +1822,286 @@ int fat16_getattr(const char* path, struct stat* stbuf, struct fuse_file_info* f
 
     DirEntrySlot slot;
     DIR_ENTRY* dir = &(slot.dir);
-    int ret = find_entry(path, &slot);
+    int ret = handle_lock(path, fi, &slot);     // The size includes delayed appends
     if(ret < 0) {
         return ret;
     }
-    stbuf->st_mode = get_mode_from_attr(dir->DIR_Attr);
-    stbuf->st_size = dir->DIR_FileSize;
-    stbuf->st_blocks = dir->DIR_FileSize / PHYSICAL_SECTOR_SIZE;
-    
-    time_fat_to_unix(&stbuf->st_atim, dir->DIR_LstAccDate, 0, 0);
-    time_fat_to_unix(&stbuf->st_mtim, dir->DIR_WrtDate, dir->DIR_WrtTime, 0);
-    time_fat_to_unix(&stbuf->st_ctim, dir->DIR_CrtDate, dir->DIR_CrtTime, dir->DIR_CrtTimeTenth);
+    size_t size = file_size(&slot);
+    file_unlock(&slot);
+    entry_stat(dir, size, stbuf);
     return 0;
 }
 
+/* The listing of a directory, stored in `fi->fh` by `fat16_opendir()`. It is
+   read once and then handed out to `fat16_readdir()` page by page: the
+   offset passed to `filler()` is the index of the next entry. */
+typedef struct {
+    char name[16];              // Enough for an 8.3 name
+    DirEntrySlot slot;
+} DirListEntry;
+
+typedef struct {
+    cluster_t clus;             // First cluster of the directory, CLUSTER_FREE for the root
+    DirListEntry* entries;
+    size_t count;
+    size_t capacity;
+    bool served;                // Entries were handed out since the listing was read
+} DirList;
+
 /**
- * @brief Read directory entries from sectors starting at `first_sec` for 
- *        `nsec` number of sectors and populate them into buffer `buf` using
- *        the `filler()` function.
- *        For example, `filler(buffer, "file1.txt", NULL, 0, 0)`.
+ * @brief Append the directory entries in sectors starting at `first_sec` for
+ *        `nsec` number of sectors to `list`.
  * 
  * @param first_sec : The starting sector number
  * @param nsec      : Number of sectors
- * @param filler    : The Function used to populate results
- * @param buf       : Buffer to store the results
- * @return <int>    : Return 0 on success; -ENOERROR on error.
+ * @param parent    : First cluster of the directory, CLUSTER_FREE for the root
+ * @param list      : The listing to extend
+ * @return <int>    : Return 1 if the end of the directory was reached, 0 if
+ *                    not, -ENOERROR on error.
  */
-int fill_entries_in_sectors(sector_t first_sec, size_t nsec, fuse_fill_dir_t filler, void* buf) {
-    char sector_buffer[MAX_LOGICAL_SECTOR_SIZE];
-    char name[MAX_NAME_LEN];
-    for(size_t i=0; i < nsec; i++) {
-        /**
-         * TASK 1.2
-         * TODO:
-         *   Read directory entries from sectors [~3 lines of code]
-         * 
-         * Hint:
-         *   To make life easier for you, most of the functionalities have
-         *   already been implemented. (You only need to replace `_placeholder_`
-         *   with the correct code in the lines marked with *TODO*).
-         * 
-         *   Please complete this loop that reads content from each sector
-         *   and then iterates over directory entries to correctly all the
-         *   `filler()` function. You might consider the following steps:
-         * 
-         *   1. Use `sector_read()` to load content of the i-th sector into
-         *      `sector_buffer`. (What is the sector number?)
-         *   2. Iterate over each directory entry in `sector_buffer`. If valid,
-         *      convert the filename and call `filler()`.
-         *      Useful functions: (Read the function prototype for yourself)
-         *      - `de_is_valid()`
-         *      - `to_longname()`
-         *      - `filler()`
-         *   3. If an empty directory entry is encountered, it means that the
-         *      directory entries within that sector are already processed, 
-         *      thus no need to read more entries in this sector (Why?)
-         *      Useful functions: `de_is_free()`
-         */
-
-        //Modified 1
-        sector_t sec = first_sec + i; // TODO: Fill in the correct sector number
-        int ret = sector_read(sec, sector_buffer);
+int dir_list_sectors(sector_t first_sec, size_t nsec, cluster_t parent, DirList* list) {
+    char buffer[DIR_SCAN_SIZE];
+    size_t batch = DIR_SCAN_SIZE / meta.sector_size;   // Sectors read per request
+    for(size_t i = 0; i < nsec; i += batch) {
+        size_t n = min(batch, nsec - i);
+        int ret = sectors_read(first_sec + i, n, buffer);
         if(ret < 0) {
             return -EIO;
         }
-        //Modified 1
-        for(size_t off = 0; off < MAX_LOGICAL_SECTOR_SIZE ; off += DIR_ENTRY_SIZE ) { // TODO: Fill in the loop condition. (How big is each sector? How big is each directory entry?)
-            DIR_ENTRY* entry = (DIR_ENTRY*)(sector_buffer + off);
-            
-            if(de_is_valid(entry)) {
-                //Modified 1
-                int ret = to_longname(entry->DIR_Name,name,MAX_NAME_LEN ); // TODO: Please call `to_longname()` to convert `entry->DIR_Name` to a long filename and stores the result in `name`.
-                if(ret < 0) {
-                    return ret;
-                }
-                filler(buf, name, NULL, 0, 0);
+        for(size_t off = 0; off < n * meta.sector_size; off += DIR_ENTRY_SIZE) {
+            DIR_ENTRY* entry = (DIR_ENTRY*)(buffer + off);
+            if(de_is_free(entry)) {     // No more entries after a free one
+                return 1;
             }
-            if(de_is_free(entry)) {
-                return 0;
+            if(!de_is_valid(entry)) {
+                continue;
+            }
+            if(list->count == list->capacity) {
+                size_t capacity = max(list->capacity * 2, 64);
+                DirListEntry* entries = realloc(list->entries, capacity * sizeof(DirListEntry));
+                if(entries == NULL) {
+                    return -ENOMEM;
+                }
+                list->entries = entries;
+                list->capacity = capacity;
             }
+            DirListEntry* e = &list->entries[list->count++];
+            to_longname(entry->DIR_Name, e->name, sizeof(e->name));
+            e->slot.dir = *entry;
+            e->slot.sector = first_sec + i + off / meta.sector_size;
+            e->slot.offset = off % meta.sector_size;
+            e->slot.parent = parent;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief (Re)read the entries of the directory `list->clus` into `list`.
+ * 
+ * @return <int>: Return 0 on success, -ENOERROR on error.
+ */
+int dir_list_load(DirList* list) {
+    list->count = 0;
+    list->served = false;
+    if(list->clus == CLUSTER_FREE) {
+        int ret = dir_list_sectors(meta.root_sec, meta.root_sectors, CLUSTER_FREE, list);
+        return ret < 0 ? ret : 0;
+    }
+    for(cluster_t clus = list->clus; is_cluster_inuse(clus); clus = read_fat_entry(clus)) {
+        int ret = dir_list_sectors(cluster_first_sector(clus), meta.sec_per_clus, list->clus, list);
+        if(ret != 0) {
+            return ret < 0 ? ret : 0;
         }
     }
     return 0;
 }
 
 /**
- * @brief Read the directory specified by `path`, and populate to `buffer` using `filler()`
+ * @brief Create the listing of the directory specified by `path`.
+ * 
+ * @param path   : The path of the directory
+ * @param list   : Output parameter, free its `entries` when done
+ * @return <int> : Return 0 on success, -ENOERROR on error.
+ */
+int dir_list_open(const char* path, DirList* list) {
+    memset(list, 0, sizeof(DirList));
+    if(!path_is_root(path)) {
+        DirEntrySlot slot;
+        int ret = find_entry(path, &slot);
+        if(ret < 0) {
+            return ret;
+        }
+        if(!attr_is_directory(slot.dir.DIR_Attr)) {
+            return -ENOTDIR;
+        }
+        list->clus = slot.dir.DIR_FstClusLO;
+    }
+    int ret = dir_list_load(list);
+    if(ret < 0) {
+        free(list->entries);
+    }
+    return ret;
+}
+
+/**
+ * @brief Open the directory specified by `path` and read its listing, kept
+ *        in `fi->fh` until `fat16_releasedir()`.
+ * 
+ * @param path   : The path of the directory
+ * @param fi     : File info passed by FUSE, receives the listing
+ * @return <int> : Return 0 on success, -ENOERROR on error.
+ */
+int fat16_opendir(const char *path, struct fuse_file_info *fi) {
+    printf("opendir(path='%s')\n", path);
+    DirList* list = malloc(sizeof(DirList));
+    if(list == NULL) {
+        return -ENOMEM;
+    }
+    int ret = dir_list_open(path, list);
+    if(ret < 0) {
+        free(list);
+        return ret;
+    }
+    fi->fh = (uintptr_t)list;
+    return 0;
+}
+
+/**
+ * @brief Free the listing of a directory opened by `fat16_opendir()`.
+ * 
+ * @param path   : Ignored
+ * @param fi     : The open directory
+ * @return <int> : Return 0.
+ */
+int fat16_releasedir(const char *path, struct fuse_file_info *fi) {
+    printf("releasedir(path='%s')\n", path);
+    DirList* list = (DirList*)(uintptr_t)fi->fh;
+    if(list != NULL) {
+        free(list->entries);
+        free(list);
+    }
+    fi->fh = 0;
+    return 0;
+}
+
+/**
+ * @brief Read the directory specified by `path`, and populate to `buffer` using
+ *        `filler()`, starting from the entry at index `offset`, until `filler()`
+ *        reports a full buffer. With FUSE_READDIR_PLUS the attributes of each
+ *        entry are passed too, sparing a `fat16_getattr()` per entry.
  * 
  * @param path   : The Path of the directory to read
  * @param buf    : The buffer to store the result
- * @param filler : Function used to fill results. `filler(buffer, filename, NULL, 0, 0)`
- * @param offset : Ignored
- * @param fi     : Ignored
+ * @param filler : Function used to fill results. `filler(buffer, filename, stat, next_offset, flags)`
+ * @param offset : Index of the first entry to return, 0 to start over
+ * @param fi     : The open directory, from `fat16_opendir()`
+ * @param flags  : FUSE_READDIR_PLUS to fill in attributes
  * @return <int> : Return 0 on success, -ENOERROR on error.
  */
 int fat16_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, 
                     struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
-    printf("readdir(path='%s')\n", path);
+    printf("readdir(path='%s', offset=%ld)\n", path, offset);
 
-    if(path_is_root(path)) {
-        /**
-         * TASK 1.1
-         * TODO
-         *   Read the root directory area [~2 lines of code]
-         * 
-         * Hint:
-         *   Please modify the following two lines (marked with TODO), remove
-         *   `_placeholder_()` and replace it with the correct code (use the 
-         *   member from the global variable `meta`).
-         *
-         *   Note that `_placeholder_()` will appear frequently in later TODOs,
-         *   it is just a place holder, like a blank that you need to fill. You
-         *   should replace it with the correct code.
-         */
-        // Modified 1
-        sector_t first_sec = meta.root_sec; // TODO: Fill in the correct *starting sector number* for the root directory area. You can refer to the definition of `meta`.
-        size_t nsec = meta.root_sectors; // TODO: Fill in the correct *number of sectors* for the root directory area.
-        fill_entries_in_sectors(first_sec, nsec, filler, buf);
-        return 0;
+    DirList local;
+    DirList* list = fi != NULL ? (DirList*)(uintptr_t)fi->fh : NULL;
+    int ret = 0;
+    if(list == NULL) {                  // Not opened through `fat16_opendir()`
+        list = &local;
+        ret = dir_list_open(path, list);
+    } else if(offset == 0 && list->served) {    // Rewound, list the directory again
+        ret = dir_list_load(list);
     }
-
-    // Handling non-root directories, need to find the first `clus`
-    cluster_t clus = CLUSTER_END;
-    DirEntrySlot slot;
-    int ret = find_entry(path, &slot);
     if(ret < 0) {
         return ret;
     }
+    list->served = true;
+
+    bool plus = flags & FUSE_READDIR_PLUS;
+    struct stat st;
+    memset(&st, 0, sizeof(struct stat));
+    st.st_uid = meta.fs_uid;
+    st.st_gid = meta.fs_gid;
+    st.st_blksize = meta.cluster_size;
+    char sector_buffer[MAX_LOGICAL_SECTOR_SIZE];
+    for(size_t i = offset; i < list->count; i++) {
+        DirListEntry* e = &list->entries[i];
+        struct stat* attr = NULL;
+        if(plus) {      // The listing may be old: take size and times from the entry as it is now
+            DirEntrySlot now = e->slot;
+            pthread_mutex_lock(file_lock_of(&now));
+            if(sector_read(now.sector, sector_buffer) == 0) {
+                memcpy(&now.dir, sector_buffer + now.offset, sizeof(DIR_ENTRY));
+                if(memcmp(now.dir.DIR_Name, e->slot.dir.DIR_Name, FAT_NAME_LEN) == 0) {
+                    entry_stat(&now.dir, file_size(&now), &st);     // Delayed appends count too
+                    attr = &st;
+                }
+            }
+            file_unlock(&now);
+        }
+        if(filler(buf, e->name, attr, i + 1, attr != NULL ? FUSE_FILL_DIR_PLUS : 0) != 0) {
+            break;                      // Buffer full, the rest comes with the next call
+        }
+    }
+    if(list == &local) {
+        free(local.entries);
+    }
+    return 0;
+}
 
-    DIR_ENTRY* dir = &(slot.dir);
-    clus = dir->DIR_FstClusLO;    // Not root directory
-    if(!attr_is_directory(dir->DIR_Attr)) {
-        return -ENOTDIR;
+/**
+ * @brief Read `size` bytes of data starting at `offset` from the `nclus`
+ *        physically consecutive clusters starting at `clus` (an extent),
+ *        and writes into `data`.
+ * 
+ * @param clus   : Cluster number of the first cluster of the extent
+ * @param nclus  : Number of clusters in the extent
+ * @param offset : Starting offset to read, relative to the start of `clus`
+ * @param data   : Output buffer
+ * @param size   : Length of data to read
+ * @return <int> : Return the actual length of data read on success.
+ */
+int read_from_extent_at_offset(cluster_t clus, size_t nclus, off_t offset, char* data, size_t size) {
+    assert(offset + size <= nclus * meta.cluster_size);  // offset + size should not exceed the extent
+    const char *mapped = disk_map(cluster_first_sector(clus), nclus * meta.sec_per_clus);
+    if(mapped != NULL) {                // Mapped image: copy straight into `data`
+        memcpy(data, mapped + offset, size);
+        return size;
     }
-
     char sector_buffer[MAX_LOGICAL_SECTOR_SIZE];
-    char name[MAX_NAME_LEN];
-    while (is_cluster_inuse(clus)) {
-        sector_t first_sec = cluster_first_sector(clus);
-        size_t nsec = meta.sec_per_clus;
-        fill_entries_in_sectors(first_sec, nsec, filler, buf);
+    sector_t sec = cluster_first_sector(clus) + offset / meta.sector_size;
+    size_t sec_off = offset % meta.sector_size;
+    size_t pos = 0;                   // The actual number of bytes already read
 
-        clus = read_fat_entry(clus);
+    // Partial first sector
+    if(sec_off != 0 || size < meta.sector_size) {
+        int ret = sector_read(sec, sector_buffer);
+        if(ret < 0) {
+            return ret;
+        }
+        pos = min(size, meta.sector_size - sec_off);
+        memcpy(data, sector_buffer + sec_off, pos);
+        sec++;
+    }
+    // Whole sectors go straight into `data` with one request
+    size_t nsec = (size - pos) / meta.sector_size;
+    if(nsec > 0) {
+        int ret = sectors_read(sec, nsec, data + pos);
+        if(ret < 0) {
+            return ret;
+        }
+        pos += nsec * meta.sector_size;
+        sec += nsec;
     }
-    
-    return 0;
+    // Partial last sector
+    if(pos < size) {
+        int ret = sector_read(sec, sector_buffer);
+        if(ret < 0) {
+            return ret;
+        }
+        memcpy(data + pos, sector_buffer, size - pos);
+    }
+    return size;
 }
 
 /**
@@ -541,54 +2115,106 @@ int fat16_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
  * @return <int> : Return the actual length of data read on success.
  */
 int read_from_cluster_at_offset(cluster_t clus, off_t offset, char* data, size_t size) {
-    assert(offset + size <= meta.cluster_size);  // offset + size should not exceed the cluster size
-    char sector_buffer[PHYSICAL_SECTOR_SIZE];
-    /**
-     * TASK 2.2
-     * TODO:
-     *   Read data from a cluster [~5 lines of code]
-     * 
-     * Hint:
-     *   1. Calculate the sector number and offset within the sector that 
-     *      corresponds to the `offset`. You can use `cluster_first_sector()`
-     *      to find the first sector of the cluster.
-     *      However, since `offset` might exceed the size of one sector, you
-     *      might need to calculate the actual sector number and the offset
-     *      within that sector.
-     *   2. Read the sector (using `sector_read()`)
-     *   3. Move the correct portion of content from the sector to `data` buffer
-     * 
-     *   You only need to complete the following TODO parts. The majority of
-     *   work should be in calculating the sector number and offset.
-     *   Use `memcpy()` to copy to `data`.
-     */
-    uint32_t sec = cluster_first_sector(clus) + offset / meta.sector_size;   // TODO: Fill in the correct sector number
-    size_t sec_off = offset % meta.sector_size; // TODO: Fill in the correct offset within the sector.
-    size_t pos = 0;                   // The actual number of bytes already read
-    while(pos < size) {               // Not yet read completely
-        int ret = sector_read(sec, sector_buffer);
+    return read_from_extent_at_offset(clus, 1, offset, data, size);
+}
+
+/**
+ * @brief Track the access pattern of a file after a read of `size` bytes at
+ *        `offset`. While reads are sequential, the clusters following the
+ *        read are prefetched into the sector cache in the background. The
+ *        window doubles with each sequential read up to READAHEAD_MAX bytes,
+ *        and is halved by each read elsewhere in the file.
+ * 
+ * @param chain  : Cached chain of the file, from `chain_index_get()`
+ * @param offset : Offset the read started at
+ * @param size   : Number of bytes read
+ */
+void file_readahead(ChainIndex* chain, off_t offset, size_t size) {
+    bool sequential = offset == chain->ra_expect;
+    chain->ra_expect = offset + size;
+    if(!sequential) {
+        chain->ra_window /= 2;
+        chain->ra_next = 0;
+        return;
+    }
+    size_t window_max = max(READAHEAD_MAX / meta.cluster_size, 1);
+    chain->ra_window = chain->ra_window == 0 ? READAHEAD_MIN : min(chain->ra_window * 2, window_max);
+
+    size_t i = (offset + size + meta.cluster_size - 1) / meta.cluster_size;    // First cluster not read
+    size_t end = min(i + chain->ra_window, chain->nclusters);
+    i = max(i, chain->ra_next);
+    while(i < end) {                    // One request per extent
+        size_t n = 1;
+        while(i + n < end && chain->clusters[i + n] == chain->clusters[i] + n) {
+            n++;
+        }
+        disk_prefetch(cluster_first_sector(chain->clusters[i]), n * meta.sec_per_clus);
+        i += n;
+    }
+    chain->ra_next = max(chain->ra_next, end);
+}
+
+/**
+ * @brief The body of `fat16_read()`, called with the file locked.
+ * 
+ * @param slot   : Directory entry of the file
+ * @return <int> : Return the actual number of bytes read on success, -ENOERROR on failure.
+ */
+int file_read(DirEntrySlot* slot, char *buffer, size_t size, off_t offset) {
+    DIR_ENTRY* dir = &(slot->dir);
+    if(attr_is_directory(dir->DIR_Attr)) { // A directory found (instead of a file)
+        return -EISDIR;
+    }
+    ChainIndex* chain;
+    int ret = chain_index_get(slot, &chain);
+    if(ret < 0) {
+        return ret;
+    }
+    size_t total = dir->DIR_FileSize + chain->wb_len;
+    if(offset < 0 || (size_t)offset > total) {  // Offset to read from exceeds the file size
+        return -EINVAL;
+    }
+    size = min(size, total - (size_t)offset);   // The length of data to read cannot exceed the file size
+    if(size == 0) {
+        return 0;
+    }
+
+    // The part past `DIR_FileSize` comes from the delayed appends
+    size_t on_disk = offset < dir->DIR_FileSize ? min(size, (size_t)(dir->DIR_FileSize - offset)) : 0;
+    if(on_disk < size) {
+        memcpy(buffer + on_disk, chain->wb_data + (offset + on_disk - dir->DIR_FileSize), size - on_disk);
+    }
+
+    off_t start = offset;
+    size_t i = offset / meta.cluster_size;   // Index of the cluster holding `offset`
+    offset %= meta.cluster_size;
+
+    // Read extent by extent: consecutive cluster numbers are consecutive on
+    // disk, so each run of them is fetched with a single request.
+    size_t p = 0;                       // Actual number of bytes read
+    while(p < on_disk) {
+        if(i >= chain->nclusters) {     // The chain is shorter than the file size
+            if(p == 0) {
+                return -EUCLEAN;
+            }
+            return p;
+        }
+        size_t nclus = 1;
+        while(i + nclus < chain->nclusters && chain->clusters[i + nclus] == chain->clusters[i] + nclus
+                && nclus * meta.cluster_size - offset < on_disk - p) {
+            nclus++;
+        }
+        size_t read_size = min(on_disk - p, nclus * meta.cluster_size - offset);
+        int ret = read_from_extent_at_offset(chain->clusters[i], nclus, offset, buffer + p, read_size);
         if(ret < 0) {
             return ret;
         }
-        /**
-         * Hint: Use `memcpy()` to move data, starting from `sec_off`.
-         * Questions worth asking:
-         * - Move to which location within `data`?
-         * - How many bytes to move?
-         * - After moving, don't forget to update `pos`
-         * 
-         * [~3 lines of code]
-        */ 
-        // ================== Your code here =================
-        size_t byte_read = meta.sector_size - sec_off < size - pos?
-                meta.sector_size - sec_off :size - pos;
-
-        memcpy(data + pos,sector_buffer + sec_off,byte_read);
-        
-        pos += byte_read;
-        // ===================================================
-        sec_off = 0;
-        sec ++ ;
+        p += ret;
+        offset = 0;                     // Subsequent extents start reading from the beginning
+        i += nclus;
+    }
+    if(on_disk > 0) {
+        file_readahead(chain, start, on_disk);
     }
     return size;
 }
@@ -603,7 +2229,7 @@ int read_from_cluster_at_offset(cluster_t clus, off_t offset, char* data, size_t
  * @param buffer : Result buffer
  * @param size   : Length of data to read
  * @param offset : Offset within the file where the data read starts
- * @param fi     : Ignored
+ * @param fi     : The open file, from `fat16_open()`
  * @return <int> : Return the actual number of bytes read on success, or 0 on failure.
  */
 int fat16_read(const char *path, char *buffer, size_t size, off_t offset,
@@ -614,78 +2240,135 @@ int fat16_read(const char *path, char *buffer, size_t size, off_t offset,
     }
 
     DirEntrySlot slot;
-    DIR_ENTRY* dir = &(slot.dir);
-    int ret = find_entry(path, &slot);  // Find the directory entry corresponding to the file
+    int ret = handle_lock(path, fi, &slot);     // Find the directory entry corresponding to the file
     if(ret < 0) {                       // Error in finding the directory entry
         return ret;
     }
-    if(attr_is_directory(dir->DIR_Attr)) { // A directory found (instead of a file)
+    ret = file_read(&slot, buffer, size, offset);
+    file_unlock(&slot);
+    return ret;
+}
+
+/**
+ * @brief The body of `fat16_read_buf()`, called with the file locked. Each
+ *        extent of the range becomes a buffer that points into the image
+ *        file, so that FUSE can splice the data without copying it; the
+ *        delayed appends are copied into a memory buffer. If `disk_fd()`
+ *        offers no descriptor (mapped image, seek model), the range is
+ *        copied by `file_read()` instead, with its read-ahead.
+ * 
+ * @param slot   : Directory entry of the file
+ * @param bufp   : Output parameter, the buffers, allocated with `malloc()`
+ * @return <int> : Return 0 on success, -ENOERROR on failure.
+ */
+int file_read_buf(DirEntrySlot* slot, struct fuse_bufvec** bufp, size_t size, off_t offset) {
+    DIR_ENTRY* dir = &(slot->dir);
+    if(attr_is_directory(dir->DIR_Attr)) {
         return -EISDIR;
     }
-    if(offset > dir->DIR_FileSize) {    // Offset to read from exceeds the file size
+    ChainIndex* chain;
+    int ret = chain_index_get(slot, &chain);
+    if(ret < 0) {
+        return ret;
+    }
+    size_t total = dir->DIR_FileSize + chain->wb_len;
+    if(offset > total) {
         return -EINVAL;
     }
-    size = min(size, dir->DIR_FileSize - offset);  // The length of data to read cannot exceed the file size
-
-
-    if(offset + size <= meta.cluster_size) {    // Case where the file is within one cluster
-        cluster_t clus = dir->DIR_FstClusLO;
-        int ret = read_from_cluster_at_offset(clus, offset, buffer, size);
-        return ret;
+    size = min(size, total - offset);
+    size_t on_disk = offset < dir->DIR_FileSize ? min(size, dir->DIR_FileSize - offset) : 0;
+
+    // At most one buffer per cluster, plus one for the delayed appends
+    size_t first = offset / meta.cluster_size;
+    size_t last = on_disk > 0 ? (offset + on_disk - 1) / meta.cluster_size : first;
+    size_t nbuf = last - first + 2;
+    struct fuse_bufvec* bufv = malloc(sizeof(struct fuse_bufvec) + (nbuf - 1) * sizeof(struct fuse_buf));
+    if(bufv == NULL) {
+        return -ENOMEM;
+    }
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = 0;
+
+    size_t i = first;
+    size_t clus_off = offset % meta.cluster_size;
+    for(size_t p = 0; p < on_disk; ) {
+        if(i >= chain->nclusters) {     // The chain is shorter than the file size
+            free(bufv);
+            return -EIO;
+        }
+        size_t nclus = 1;
+        while(i + nclus < chain->nclusters && chain->clusters[i + nclus] == chain->clusters[i] + nclus
+                && nclus * meta.cluster_size - clus_off < on_disk - p) {
+            nclus++;
+        }
+        size_t len = min(on_disk - p, nclus * meta.cluster_size - clus_off);
+        off_t pos;
+        int fd = disk_fd(cluster_first_sector(chain->clusters[i]), nclus * meta.sec_per_clus, &pos);
+        if(fd < 0) {                    // Must be read through the cache: copy into memory instead
+            free(bufv);
+            bufv = malloc(sizeof(struct fuse_bufvec));
+            char* data = malloc(max(size, 1));
+            ret = bufv == NULL || data == NULL ? -ENOMEM : file_read(slot, data, size, offset);
+            if(ret < 0) {
+                free(bufv);
+                free(data);
+                return ret;
+            }
+            *bufv = FUSE_BUFVEC_INIT(ret);
+            bufv->buf[0].mem = data;
+            *bufp = bufv;
+            return 0;
+        }
+        struct fuse_buf* buf = &bufv->buf[bufv->count++];
+        *buf = (struct fuse_buf){ .size = len, .flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK, .fd = fd, .pos = pos + clus_off };
+        p += len;
+        clus_off = 0;
+        i += nclus;
+    }
+    if(on_disk < size) {
+        char* data = malloc(size - on_disk);
+        if(data == NULL) {
+            free(bufv);
+            return -ENOMEM;
+        }
+        memcpy(data, chain->wb_data + (offset + on_disk - dir->DIR_FileSize), size - on_disk);
+        struct fuse_buf* buf = &bufv->buf[bufv->count++];
+        *buf = (struct fuse_buf){ .size = size - on_disk, .mem = data };
     }
+    *bufp = bufv;
+    return 0;
+}
 
-    // Reading a file that spans multiple clusters
-    cluster_t clus = dir->DIR_FstClusLO;
-    size_t p = 0;                       // Actual number of bytes read
-    while(offset >= meta.cluster_size) {// Move to the correct cluster number
-        if(!is_cluster_inuse(clus)) {
-            return -EUCLEAN;
-        }
-        offset -= meta.cluster_size;    // If offset is larger than the size of a cluster, move to the next cluster, reduce offset by the size of one cluster
-        clus = read_fat_entry(clus);    // Read the FAT entry
+/**
+ * @brief Read `size` bytes starting from `offset` from the file specified by
+ *        `path` as buffers that FUSE copies to the kernel itself: extents are
+ *        passed as ranges of the image file, which FUSE can splice.
+ * 
+ * @param path   : Path of file to read
+ * @param bufp   : Output parameter, the buffers, freed by FUSE
+ * @param size   : Length of data to read
+ * @param offset : Offset within the file where the data read starts
+ * @param fi     : The open file, from `fat16_open()`
+ * @return <int> : Return 0 on success, -ENOERROR on failure.
+ */
+int fat16_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                   struct fuse_file_info *fi) {
+    printf("read_buf(path='%s', offset=%ld, size=%lu)\n", path, offset, size);
+    if(path_is_root(path)) {
+        return -EISDIR;
     }
 
-    /**
-     * TASK 4.2
-     * TODO:
-     *   Read data from multiple clusters [~10 lines of code]
-     * Hint:
-     *   You will need to write a loop to read the correct data from the
-     *   current cluster:
-     *   1. Write a while loop to confirm that there is more data to read,
-     *      and the cluster number `clus` is valid.
-     *      You can use `is_cluster_inuse()`
-     *   2. Calculate the length of data you need to read (starting from
-     *      `offset`). There are two scenarios:
-     *      1. Read to the end of the cluster. What is the length?
-     *      2. The remaining data does not need to read the end of the
-     *         cluster. What is the length?
-     *   3. Use the `read_from_cluster_at_offset()` function to read data.
-     *      Be careful to check the return value.
-     *   4. Update `p` (number of bytes read), `offset` (offset for the next
-     *      cluster), and `clus` (next cluster number).
-     *      Actually, `offset` will definitely be `0`, because apart from 
-     *      the first cluster, all subsequent clusters are read from the 
-     *      beginning. `clus` needs to be updated by reading the FAT table, 
-     *      don't forget you've already implemented `read_fat_entry()`.
-     */
-    // ================== Your code here =================
-    
-     while (p < size && is_cluster_inuse(clus)) {
-        size_t read_size = min(size - p, meta.cluster_size - offset);
-        int ret = read_from_cluster_at_offset(clus, offset, buffer + p, read_size);
-        if (ret < 0) {
-            return ret;
-        }
-        p += ret;
-        offset = 0; // Subsequent clusters start reading from the beginning
-        clus = read_fat_entry(clus); // Move to the next cluster
+    DirEntrySlot slot;
+    int ret = handle_lock(path, fi, &slot);
+    if(ret < 0) {
+        return ret;
     }
-    
-    // ===================================================
-    return p;
+    ret = file_read_buf(&slot, bufp, size, offset);
+    file_unlock(&slot);
+    return ret;
 }
 
+
 int dir_entry_write(DirEntrySlot slot) {
     /**
      * TASK 3.2
@@ -703,17 +2386,22 @@ int dir_entry_write(DirEntrySlot slot) {
      */
 
     char sector_buffer[MAX_LOGICAL_SECTOR_SIZE];
+    // Entries sharing a sector belong to one directory, so its index lock
+    // also makes the read-modify-write of the sector atomic.
+    pthread_mutex_lock(dir_index_lock(slot.parent));
     //Modified 1
     int ret = sector_read(slot.sector, sector_buffer); // TODO: Use `sector_read()` to read the entire sector
-    if(ret < 0) {
-        return ret;
-    }
-    memcpy(sector_buffer + slot.offset, &(slot.dir), sizeof(DIR_ENTRY));
-    ret = sector_write(slot.sector, sector_buffer); // TODO: Use `sector_write()` to write back the sector.
-    if(ret < 0) {
-        return ret;
+    if(ret == 0) {
+        DIR_ENTRY old = *(DIR_ENTRY*)(sector_buffer + slot.offset);
+        memcpy(sector_buffer + slot.offset, &(slot.dir), sizeof(DIR_ENTRY));
+        ret = sector_write(slot.sector, sector_buffer); // TODO: Use `sector_write()` to write back the sector.
+        if(ret == 0) {
+            dentry_cache_update(&slot);
+            dir_index_update(&slot, &old);
+        }
     }
-    return 0;
+    pthread_mutex_unlock(dir_index_lock(slot.parent));
+    return ret;
 }
 
 int dir_entry_create(DirEntrySlot slot, const char *shortname, 
@@ -780,21 +2468,60 @@ int fat16_mknod(const char *path, mode_t mode, dev_t dev) {
     printf("mknod(path='%s', mode=%03o, dev=%lu)\n", path, mode, dev);
     DirEntrySlot slot;
     const char* filename = NULL;
-    int ret = find_empty_slot(path, &slot, &filename);  // Find an empty directory entry
+    cluster_t parent, self;
+    int ret = dir_lock_path(path, false, &parent, &self);
     if(ret < 0) {
         return ret;
     }
+    ret = find_empty_slot(path, &slot, &filename);  // Find an empty directory entry
 
     char shortname[11];
-    ret = to_shortname(filename, MAX_NAME_LEN, shortname); // Convert long filename to short filename
-    if(ret < 0) {
-        return ret;
+    if(ret == 0) {
+        ret = to_shortname(filename, MAX_NAME_LEN, shortname); // Convert long filename to short filename
+    }
+    if(ret == 0) {
+        ret = dir_entry_create(slot, shortname, ATTR_REGULAR, 0, 0); // Create directory entry
+    }
+    if(ret == 0) {
+        dentry_cache_forget(path, false);   // Drop the cached "does not exist"
+    }
+    dir_unlock(parent, self);
+    return ret;
+}
+
+/**
+ * @brief Change the FAT entry of `clus` in `fat_cache` only, and mark its
+ *        sector dirty for the next `fat_cache_flush()`. Caller holds
+ *        `fat_lock` exclusively.
+ */
+int fat_entry_update(cluster_t clus, cluster_t data) {
+    if(clus >= fat_cache.nentries) {
+        return -EINVAL;
+    }
+    if(clus >= CLUSTER_MIN && clus < fat_cache.limit
+            && (fat_cache.entries[clus] == CLUSTER_FREE) != (data == CLUSTER_FREE)) {
+        fat_cache.free_map[clus / 64] ^= 1ull << (clus % 64);
+        if(data == CLUSTER_FREE) {
+            fat_cache.nfree++;
+        } else {
+            fat_cache.nfree--;
+        }
     }
-    ret = dir_entry_create(slot, shortname, ATTR_REGULAR, 0, 0); // Create directory entry
+    fat_cache.entries[clus] = data;
+    size_t fat_sec_idx = clus * sizeof(cluster_t) / meta.sector_size;
+    fat_cache.dirty[fat_sec_idx / 64] |= 1ull << (fat_sec_idx % 64);
+    return 0;
+}
+
+/**
+ * @brief Same as `write_fat_entry()`, for callers already holding `fat_lock` exclusively.
+ */
+int fat_entry_set(cluster_t clus, cluster_t data) {
+    int ret = fat_entry_update(clus, data);
     if(ret < 0) {
         return ret;
     }
-    return 0;
+    return fat_cache_flush();
 }
 
 /**
@@ -807,73 +2534,84 @@ int fat16_mknod(const char *path, mode_t mode, dev_t dev) {
  * @return <int>: Return 0 on success.
  */
 int write_fat_entry(cluster_t clus, cluster_t data) {
-    char sector_buffer[MAX_LOGICAL_SECTOR_SIZE];
-    size_t clus_off = clus * sizeof(cluster_t);
-    sector_t clus_sec = clus_off / meta.sector_size;
-    size_t sec_off = clus_off % meta.sector_size;
-    for(size_t i = 0; i < meta.fats; i++) {
-        /**
-         * TASK 6.2
-         * TODO:
-         *   Modify FAT table entry [~10 lines of code, ~4 core lines of code]
-         * Hint:
-         *   Modify the table entry at `sec_off` offset in `clus_sec` sector
-         *   of the i-th FAT table, so that its value becomes `data`.
-         *   1. Calculate the sector of the i-th FAT table where `clus` belongs,
-         *      further calculate the sector where the FAT table entry for `clus`
-         *      is located.
-         *   2. Read that sector and modify the data at the corresponding position.
-         *   3. Write back the sector.
-         */
-        // ================== Your code here =================
-        //Modified 1
-        // 1. Calculate the sector of the i-th FAT table where `clus` belongs
-        sector_t fat_table_sec = meta.fat_sec + i * meta.sec_per_fat + clus_sec;
-
-        // 2. Read that sector and modify the data at the corresponding position
-        int ret = sector_read(fat_table_sec, sector_buffer);
-        if (ret < 0) {
-            return ret;
-        }
-
-        // Modify the table entry at `sec_off` offset
-        //memcpy(sector_buffer + sec_off, &data, sizeof(cluster_t));
-        *((cluster_t*)&sector_buffer[sec_off]) = data;
-
-        // 3. Write back the sector
-        ret = sector_write(fat_table_sec, sector_buffer);
-        if (ret < 0) {
-            return ret;
-        }
-        
-        // ===================================================
+    int ret = fat_write_lock();
+    if(ret < 0) {
+        return ret;
     }
-    return 0;
+    ret = fat_entry_set(clus, data);
+    pthread_rwlock_unlock(&fat_lock);
+    return ret;
 }
 
+
 int free_clusters(cluster_t clus) {
-    while(is_cluster_inuse(clus)) {
-        cluster_t next = read_fat_entry(clus);
-        int ret = write_fat_entry(clus, CLUSTER_FREE);
-        if(ret < 0) {
-            return ret;
-        }
+    int ret = fat_write_lock();
+    if(ret < 0) {
+        return ret;
+    }
+    while(is_cluster_inuse(clus) && clus < fat_cache.nentries && ret == 0) {
+        cluster_t next = fat_cache.entries[clus];
+        ret = fat_entry_update(clus, CLUSTER_FREE);
         clus = next;
     }
-    return 0;
+    if(ret == 0) {
+        ret = fat_cache_flush();
+    }
+    pthread_rwlock_unlock(&fat_lock);
+    return ret;
 }
 
 
-static const char ZERO_SECTOR[PHYSICAL_SECTOR_SIZE] = {0};
 int cluster_clear(cluster_t clus) {
-    sector_t first_sec = cluster_first_sector(clus);
-    for(size_t i = 0; i < meta.sec_per_clus; i++) {
-        sector_t sec = first_sec + i;
-        int ret = sector_write(sec, ZERO_SECTOR);
-        if(ret < 0) {
-            return ret;
+    return sectors_write(cluster_first_sector(clus), meta.sec_per_clus, zero_cluster);
+}
+
+/**
+ * @brief Pick `n` free clusters without allocating them, leaving the clusters
+ *        reserved for delayed appends alone. The first run of `n`
+ *        contiguous free clusters at or after the rotor is preferred; if there
+ *        is none, the first `n` free clusters from the rotor on are taken. The
+ *        search wraps around the end of the volume, and the rotor moves past
+ *        the picked clusters. Caller holds `fat_lock` exclusively.
+ *
+ * @param n        : Number of clusters to pick
+ * @param reserved : How many of them the caller had reserved, see `alloc_chain()`
+ * @param clusters : Output parameter, the `n` picked cluster numbers
+ * @return <int>   : Return 0 on success, -ENOSPC if there are not enough free clusters.
+ */
+int pick_free_clusters(size_t n, size_t reserved, cluster_t* clusters) {
+    if(n > fat_cache.nfree - (fat_cache.reserved - reserved)) {
+        return -ENOSPC;
+    }
+    size_t rotor = max(CLUSTER_MIN, min(fat_cache.rotor, fat_cache.limit));
+    size_t ranges[2][2] = {{rotor, fat_cache.limit}, {CLUSTER_MIN, rotor}};
+    for(size_t r = 0; r < 2; r++) {
+        size_t end = ranges[r][1];
+        size_t c = fat_free_map_next(ranges[r][0], end, true);
+        while(c < end) {
+            size_t run_end = fat_free_map_next(c, end, false);
+            if(run_end - c >= n) {
+                for(size_t i = 0; i < n; i++) {
+                    clusters[i] = c + i;
+                }
+                fat_cache.rotor = c + n;
+                return 0;
+            }
+            c = fat_free_map_next(run_end, end, true);
+        }
+    }
+
+    // No run is long enough: take free clusters in order from the rotor on
+    size_t picked = 0;
+    for(size_t r = 0; r < 2 && picked < n; r++) {
+        size_t end = ranges[r][1];
+        for(size_t c = fat_free_map_next(ranges[r][0], end, true); c < end && picked < n;
+                c = fat_free_map_next(c + 1, end, true)) {
+            clusters[picked++] = c;
         }
     }
+    assert(picked == n);
+    fat_cache.rotor = clusters[n - 1] + 1;
     return 0;
 }
 
@@ -884,70 +2622,93 @@ int cluster_clear(cluster_t clus) {
  * @return <int>: Return 0 on success, -ENOERROR on failure.
  */
 int alloc_one_cluster(cluster_t* clus) {
-    /**
-     * TASK 6.3
-     * TODO:
-     *   Allocate a free cluster [~15 lines of code]
-     * Hint:
-     *   1. Scan the FAT table, find a free cluster.
-     *   2. If no free cluster is found, allocation fails, return `-ENOSPC`
-     *   3. Modify the corresponding FAT table entry for the free cluster
-     *      to point to `CLUSTER_END`. Also clear the cluster (use the 
-     *      `cluster_clear()` function).
-     *   4. Set `first_clus` to the cluster number of the first cluster,
-     *      release clusters.(?)
-     */
-    
-    // ================== Your code here =================
-    //Modified 1
-     char sector_buffer[MAX_LOGICAL_SECTOR_SIZE];
-    
-    for (cluster_t i = 2; i < meta.clusters; i++) { // FAT16保留前两个簇（0和1）
-        cluster_t entry;
-        size_t clus_off = i * sizeof(cluster_t); // Notice here
-        sector_t clus_sec = clus_off / meta.sector_size;
-        size_t sec_off = clus_off % meta.sector_size;
-
-        // 读取FAT表项
-        sector_t fat_table_sec = meta.fat_sec + clus_sec;
-        int ret = sector_read(fat_table_sec, sector_buffer);
-        if (ret < 0) {
-            return ret;
-        }
-
-        //Modified 1
-        entry = *((cluster_t*)&sector_buffer[sec_off]);
-
-        
-
-        // 如果找到了空闲簇
-        if (entry == CLUSTER_FREE) {
-            *clus = i;
-
-            // 修改FAT表项指向CLUSTER_END
-            entry = CLUSTER_END;
-            //memcpy(sector_buffer + sec_off, &entry, sizeof(cluster_t));
-            *((cluster_t*)&sector_buffer[sec_off]) = entry;
-
-            // 写回FAT表项
-            ret = sector_write(fat_table_sec, sector_buffer);
-            if (ret < 0) {
-                return ret;
-            }
+    cluster_t free_clus;
+    int ret = fat_write_lock();
+    if(ret < 0) {
+        return ret;
+    }
+    ret = pick_free_clusters(1, 0, &free_clus);
+    if(ret == 0) {
+        ret = fat_entry_set(free_clus, CLUSTER_END);
+    }
+    pthread_rwlock_unlock(&fat_lock);
+    if(ret < 0) {
+        return ret;
+    }
+    ret = cluster_clear(free_clus);
+    if(ret < 0) {
+        return ret;
+    }
+    *clus = free_clus;
+    return 0;
+}
 
-            
-            // 清空簇
-            ret = cluster_clear(*clus);
-            if (ret < 0) {
-                return ret;
-            }
+/**
+ * @brief Allocate `n` free clusters linked into a chain ending with
+ *        `CLUSTER_END`, and append it to the chain ending at `prev` unless
+ *        `prev` is `CLUSTER_FREE`. The search for free clusters starts right
+ *        after `prev`, and all FAT updates go to disk in one batched flush.
+ *        The clusters are only zeroed if `clear` is set: file data past
+ *        `DIR_FileSize` is never read, so clusters of a file are left as
+ *        they are and filled by the write or truncate that needs them.
+ *
+ * @param n          : Number of clusters to allocate
+ * @param prev       : Last cluster of the chain to extend, or `CLUSTER_FREE`
+ * @param clear      : Zero the new clusters
+ * @param reserved   : Clusters the caller reserved in `fat_cache.reserved`, or NULL. Up to
+ *                     `n` of them are used up and taken off, under `fat_lock`
+ * @param first_clus : Output parameter, used to save the cluster number of the first cluster
+ * @return <int>     : Return 0 on success, -ENOERROR on failure.
+ */
+int alloc_chain(size_t n, cluster_t prev, bool clear, size_t* reserved, cluster_t* first_clus) {
+    // To save the `n` free clusters, also include `CLUSTER_END` at the end, in total `n+1` clusters.
+    cluster_t *clusters = malloc((n + 1) * sizeof(cluster_t));
+    if(clusters == NULL) {
+        return -ENOMEM;
+    }
+    int ret = fat_write_lock();
+    if(ret < 0) {
+        free(clusters);
+        return ret;
+    }
+    if(prev != CLUSTER_FREE) {          // Try to continue right after the chain
+        fat_cache.rotor = prev + 1;
+    }
+    size_t used = reserved != NULL ? min(*reserved, n) : 0;
+    ret = pick_free_clusters(n, used, clusters);
+    if(ret < 0) {
+        pthread_rwlock_unlock(&fat_lock);
+        free(clusters);
+        return ret;
+    }
+    if(used > 0) {
+        fat_cache.reserved -= used;
+        *reserved -= used;
+    }
 
-            return 0;
-        }
+    // Link the clusters into a chain ending with `CLUSTER_END`, then clear them
+    clusters[n] = CLUSTER_END;
+    for(size_t i = 0; i < n && ret == 0; i++) {
+        ret = fat_entry_update(clusters[i], clusters[i + 1]);
+    }
+    if(ret == 0 && prev != CLUSTER_FREE) {
+        ret = fat_entry_update(prev, clusters[0]);
+    }
+    if(ret == 0) {
+        ret = fat_cache_flush();
+    }
+    pthread_rwlock_unlock(&fat_lock);
+    for(size_t i = 0; i < n && ret == 0 && clear; i++) {
+        ret = cluster_clear(clusters[i]);
     }
-    
-    // ===================================================
-    return -ENOSPC;    // TODO: Delete this line or modify to the correct return value.
+    if(ret < 0) {
+        free(clusters);
+        return ret;
+    }
+    *first_clus = clusters[0];
+
+    free(clusters);
+    return 0;
 }
 
 /**
@@ -963,109 +2724,48 @@ int alloc_one_cluster(cluster_t* clus) {
 int alloc_clusters(size_t n, cluster_t* first_clus) {
     if (n == 0)
         return CLUSTER_END;
+    return alloc_chain(n, CLUSTER_FREE, true, NULL, first_clus);
+}
 
-    // To save the `n` free clusters, also include `CLUSTER_END` at the end, in total `n+1` clusters.
-    cluster_t *clusters = malloc((n + 1) * sizeof(cluster_t));
-    size_t allocated = 0;    // Number of free clusters already found.
-
-    /**
-     * TASK 8.3
-     * TODO:
-     *   Allocate `n` free clusters
-     * Hint:
-     *   1. Scan the FAT table, find `n` free clusters, store them in the
-     *      `clusters` array. Note that, at this point, you do not need to
-     *      modify the corresponding FAT table entries.
-     *   2. If `n` clusters are not found, allocation fails, remember to 
-     *      `free(clusters)`, and then return `-ENOSPC`.
-     *   3. Modify the FAT table entries stored in `clusters` to connect 
-     *      each cluster to the next one. Also, clear each newly allocated
-     *      cluster. Remember to connect the last cluster to `CLUSTER_END`.
-     *   4. Set `first_clus` to the cluster number of the first cluster, 
-     *      release `clusters`.
-     */
-
-
-    // ================== Your code here =================
-      char sector_buffer[MAX_LOGICAL_SECTOR_SIZE];
-    for (cluster_t i = 2; i < meta.clusters; i++) { // FAT16保留前两个簇（0和1）
-        cluster_t entry;
-        size_t clus_off = i * sizeof(cluster_t);
-        sector_t clus_sec = clus_off / meta.sector_size;
-        size_t sec_off = clus_off % meta.sector_size;
-
-        // 读取FAT表项
-        sector_t fat_table_sec = meta.fat_sec + clus_sec;
-        int ret = sector_read(fat_table_sec, sector_buffer);
-        if (ret < 0) {
-            free(clusters);
-            return ret;
-        }
-
-        entry = *((cluster_t*)&sector_buffer[sec_off]);
-
-        // 如果找到了空闲簇
-        if (entry == CLUSTER_FREE) {
-            clusters[allocated++] = i;
-            if (allocated == n) {
-                break;
-            }
+/**
+ * @brief Add a cluster to the subdirectory starting at cluster `first`, which
+ *        is full, and return its first entry as an empty slot in `slot`.
+ * 
+ * @return <int>: Return 0 on success, -ENOERROR on failure.
+ */
+int dir_grow(cluster_t first, DirEntrySlot* slot) {
+    DirIndex* idx;
+    pthread_mutex_lock(dir_index_lock(first));
+    int ret = dir_index_get(first, &idx);
+    cluster_t clus;
+    if(ret == 0) {
+        ret = alloc_one_cluster(&clus);     // Comes zeroed, i.e. all entries free
+    }
+    if(ret == 0) {
+        ret = write_fat_entry(idx->clusters[idx->nclusters - 1], clus);
+        if(ret < 0) {
+            free_clusters(clus);
         }
     }
-
-    if (allocated < n) {
-        free(clusters);
-        return -ENOSPC;
-    }
-
-    // Modify the FAT table entries to connect each cluster to the next one.
-    for (size_t i = 0; i < n; i++) {
-        cluster_t clus = clusters[i];
-        cluster_t next_clus = (i == n - 1) ? CLUSTER_END : clusters[i + 1];
-
-        size_t clus_off = clus * sizeof(cluster_t);
-        sector_t clus_sec = clus_off / meta.sector_size;
-        size_t sec_off = clus_off % meta.sector_size;
-
-        sector_t fat_table_sec = meta.fat_sec + clus_sec;
-        int ret = sector_read(fat_table_sec, sector_buffer);
-        if (ret < 0) {
-            free(clusters);
-            return ret;
-        }
-
-        *((cluster_t*)&sector_buffer[sec_off]) = next_clus;
-        ret = sector_write(fat_table_sec, sector_buffer);
-        if (ret < 0) {
-            free(clusters);
-            return ret;
-        }
-
-        // Clear the cluster
-        ret = cluster_clear(clus);
-        if (ret < 0) {
-            free(clusters);
-            return ret;
+    if(ret == 0) {
+        ret = dir_index_add_cluster(idx, clus);
+        if(ret < 0) {
+            dir_index_free(idx);
         }
     }
-
-    *first_clus = clusters[0];
-    // ===================================================
-
-    free(clusters);
-    return 0;
+    if(ret == 0) {
+        dir_index_locate(idx, idx->end, slot);
+        memset(&slot->dir, 0, sizeof(DIR_ENTRY));
+    }
+    pthread_mutex_unlock(dir_index_lock(first));
+    return ret;
 }
 
 
 /**
- * @brief Create a directory at the specified `path`
- * 
- * @param path   : Path where the directory is to be created
- * @param mode   : Directory mode, can be ignored here. (All directories can be assumed to be regular directories by default.)
- * @return <int> : Return 0 on success, -ENOERROR on failure.
+ * @brief The body of `fat16_mkdir()`, called with the parent directory locked.
  */
-int fat16_mkdir(const char *path, mode_t mode) {
-    printf("mkdir(path='%s', mode=%03o)\n", path, mode);
+int mkdir_internal(const char *path) {
     DirEntrySlot slot = {{}, 0, 0};
     const char* filename = NULL;
     cluster_t dir_clus = 0; // Cluster number of the newly created directory
@@ -1103,33 +2803,52 @@ int fat16_mkdir(const char *path, mode_t mode) {
     if (ret < 0) {
         return ret;
     }
+
+    // Set `.` and `..` directory entries before the directory becomes visible
+    const char DOT_NAME[] =    ".          ";
+    const char DOTDOT_NAME[] = "..         ";
+    sector_t sec = cluster_first_sector(dir_clus);
+    DirEntrySlot dot_slot = {.sector=sec, .offset=0, .parent=dir_clus};
+    ret = dir_entry_create(dot_slot, DOT_NAME, ATTR_DIRECTORY, dir_clus, 0);
+    if(ret == 0) {
+        DirEntrySlot dotdot_slot = {.sector=sec, .offset=DIR_ENTRY_SIZE, .parent=dir_clus};
+        ret = dir_entry_create(dotdot_slot, DOTDOT_NAME, ATTR_DIRECTORY, slot.parent, 0);
+    }
     
     // Create a new directory entry in the parent directory
-    ret = dir_entry_create(slot, shortname, ATTR_DIRECTORY, dir_clus, 0);
+    if(ret == 0) {
+        ret = dir_entry_create(slot, shortname, ATTR_DIRECTORY, dir_clus, 0);
+    }
     if (ret < 0) {
+        free_clusters(dir_clus);
         return ret;
     }
-
+    dentry_cache_forget(path, false);   // Drop the cached "does not exist"
     
     // ===================================================
+    return 0;
+}
 
-    // Set `.` and `..` directory entries
-    const char DOT_NAME[] =    ".          ";
-    const char DOTDOT_NAME[] = "..         ";
-    sector_t sec = cluster_first_sector(dir_clus);
-    DirEntrySlot dot_slot = {.sector=sec, .offset=0};
-    ret = dir_entry_create(dot_slot, DOT_NAME, ATTR_DIRECTORY, dir_clus, 0);
-    if(ret < 0) {
-        return ret;
-    }
-    DirEntrySlot dotdot_slot = {.sector=sec, .offset=DIR_ENTRY_SIZE};
-    ret = dir_entry_create(dotdot_slot, DOTDOT_NAME, ATTR_DIRECTORY, sector_cluster(slot.sector), 0);
+/**
+ * @brief Create a directory at the specified `path`
+ * 
+ * @param path   : Path where the directory is to be created
+ * @param mode   : Directory mode, can be ignored here. (All directories can be assumed to be regular directories by default.)
+ * @return <int> : Return 0 on success, -ENOERROR on failure.
+ */
+int fat16_mkdir(const char *path, mode_t mode) {
+    printf("mkdir(path='%s', mode=%03o)\n", path, mode);
+    cluster_t parent, self;
+    int ret = dir_lock_path(path, false, &parent, &self);
     if(ret < 0) {
         return ret;
     }
-    return 0;
+    ret = mkdir_internal(path);
+    dir_unlock(parent, self);
+    return ret;
 }
 
+
 /**
  * @brief Delete the file specified by `path`
  * 
@@ -1164,47 +2883,77 @@ int fat16_unlink(const char *path) {
      */
     // ================== Your code here =================
     //Modifie 1
-     int ret = find_entry(path, &slot);
+    // Like the create paths, hold the parent so that no entry is created or deleted there meanwhile
+    cluster_t parent, self;
+    int ret = dir_lock_path(path, false, &parent, &self);
     if (ret < 0) {
         return ret;
     }
+    ret = file_lock(path, &slot);  // Nobody may read or write the file while it goes
+    if (ret < 0) {
+        dir_unlock(parent, self);
+        return ret;
+    }
 
-    
-   
     if (attr_is_directory(dir->DIR_Attr)) {
-        return -EISDIR;
+        ret = -EISDIR;
+    } else {
+        chain_index_invalidate(&slot);
+        ret = free_clusters(dir->DIR_FstClusLO);
     }
-    
-    ret = free_clusters(dir->DIR_FstClusLO);
-    if (ret < 0) {
-        return ret;
+    if (ret == 0) {
+        dir->DIR_Name[0] = NAME_DELETED;  // Mark as deleted
+        ret = dir_entry_write(slot);
     }
-    
-    dir->DIR_Name[0] = NAME_DELETED;  // Mark as deleted
-    ret = dir_entry_write(slot);
-    if (ret < 0) {
-        return ret;
+    if (ret == 0) {
+        handle_unlink(&slot);
     }
-
-    
+    file_unlock(&slot);
+    dir_unlock(parent, self);
     
     // ===================================================
     //Modified 2
-    return 0; // TODO: Please modify the return value.
+    return ret;
 }
 
 /**
- * @brief Delete the directory specified by `path`
+ * @brief Check whether the directory starting at cluster `clus` contains
+ *        nothing but the `.` and `..` entries. Each cluster is scanned with
+ *        one multi-sector read.
  * 
- * @param path   : Path of the directory to be deleted
- * @return <int> : Return 0 on success, -ENOERROR on failure.
+ * @param clus   : First cluster of the directory
+ * @return <int> : Return 1 if empty, 0 if not empty, -ENOERROR on failure.
  */
-int fat16_rmdir(const char *path) {
-    printf("rmdir(path='%s')\n", path);
-    if(path_is_root(path)) {    // The root directory cannot be deleted
-        return -EBUSY;
+int dir_is_empty(cluster_t clus) {
+    char buffer[DIR_SCAN_SIZE];
+    size_t batch = DIR_SCAN_SIZE / meta.sector_size;   // Sectors read per request
+    while(is_cluster_inuse(clus)) {
+        sector_t first_sec = cluster_first_sector(clus);
+        for(size_t i = 0; i < meta.sec_per_clus; i += batch) {
+            size_t n = min(batch, meta.sec_per_clus - i);
+            int ret = sectors_read(first_sec + i, n, buffer);
+            if(ret < 0) {
+                return ret;
+            }
+            for(size_t off = 0; off < n * meta.sector_size; off += DIR_ENTRY_SIZE) {
+                DIR_ENTRY* entry = (DIR_ENTRY*)(buffer + off);
+                if(de_is_free(entry)) {
+                    return 1;
+                }
+                if(de_is_valid(entry) && !de_is_dot(entry)) {
+                    return 0;
+                }
+            }
+        }
+        clus = read_fat_entry(clus);
     }
+    return 1;
+}
 
+/**
+ * @brief The body of `fat16_rmdir()`, called with the directory and its parent locked.
+ */
+int rmdir_internal(const char *path) {
     /**
      * TASK 7.2
      * TODO:
@@ -1231,125 +2980,373 @@ int fat16_rmdir(const char *path) {
         return -ENOTDIR;
     }
     
-    cluster_t clus = slot.dir.DIR_FstClusLO;
-    sector_t sec = cluster_first_sector(clus);
-    size_t entries = meta.cluster_size / DIR_ENTRY_SIZE;
+    ret = dir_is_empty(slot.dir.DIR_FstClusLO);
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret == 0) {
+        return -ENOTEMPTY;
+    }
+
+    ret = free_clusters(slot.dir.DIR_FstClusLO);
+    if (ret < 0) {
+        return ret;
+    }
+    
+    slot.dir.DIR_Name[0] = NAME_DELETED;  // Mark as deleted
+    ret = dir_entry_write(slot);
+    if (ret < 0) {
+        return ret;
+    }
+    dentry_cache_forget(path, true);    // Lookups below the directory are stale now
+    dir_index_drop(slot.dir.DIR_FstClusLO);
+
+    
     
+    // ===================================================
+    return 0; // TODO: Please modify the return value.
+}
+
+/**
+ * @brief Delete the directory specified by `path`
+ * 
+ * @param path   : Path of the directory to be deleted
+ * @return <int> : Return 0 on success, -ENOERROR on failure.
+ */
+int fat16_rmdir(const char *path) {
+    printf("rmdir(path='%s')\n", path);
+    if(path_is_root(path)) {    // The root directory cannot be deleted
+        return -EBUSY;
+    }
+    // Lock the directory itself too, so that nothing is created in it meanwhile
+    cluster_t parent, self;
+    int ret = dir_lock_path(path, true, &parent, &self);
+    if(ret < 0) {
+        return ret;
+    }
+    ret = rmdir_internal(path);
+    dir_unlock(parent, self);
+    return ret;
+}
+
+
+/**
+ * @brief Modify the timestamps of the file specified by `path`. This function
+ *        is not required for implementation, can be ignored.
+ * 
+ * @param path   : Path of the file whose timestamps are to be modified
+ * @param tv     : Timestamps
+ * @return <int> 
+ */
+int fat16_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info* fi) {
+    printf("utimens(path='%s', tv=[%ld.%09ld, %ld.%09ld])\n", path, 
+                tv[0].tv_sec, tv[0].tv_nsec, tv[1].tv_sec, tv[1].tv_nsec);
+    DirEntrySlot slot;
+    DIR_ENTRY* dir = &(slot.dir);
+    int ret = file_lock(path, &slot);   // Keep a concurrent size update from being overwritten
+    if(ret < 0) {
+        return ret;
+    }
+
+    time_unix_to_fat(&tv[1], &(dir->DIR_WrtDate), &(dir->DIR_WrtTime), NULL);
+    time_unix_to_fat(&tv[0], &(dir->DIR_LstAccDate), NULL, NULL);
+    ret = dir_entry_write(slot);
+    file_unlock(&slot);
+    return ret;
+}
+
+/**
+ * @brief Write data from `data` into the `nclus` physically consecutive
+ *        clusters starting at `clus` (an extent), starting at `offset`.
+ *        Only partially covered sectors are read first; all whole sectors
+ *        are written with a single request.
+ *        Note that size+offset <= nclus * cluster size
+ * 
+ * @param clus      : Cluster number of the first cluster of the extent
+ * @param nclus     : Number of clusters in the extent
+ * @param offset    : Offset where the data writing starts, relative to the start of `clus`
+ * @param data      : Data to be written
+ * @param size      : Size of data to be written (in bytes)
+ * @return <ssize_t>: Return number of bytes written on success, -ENOERROR on failure.
+ */
+ssize_t write_to_extent_at_offset(cluster_t clus, size_t nclus, off_t offset, const char* data, size_t size) {
+    assert(offset + size <= nclus * meta.cluster_size);  // offset + size must not exceed the extent
     char sector_buffer[MAX_LOGICAL_SECTOR_SIZE];
-    for (size_t i = 0; i < entries; i++) {
-        ret = sector_read(sec + i / (meta.sector_size / DIR_ENTRY_SIZE), sector_buffer);
-        if (ret < 0) {
+    sector_t sec = cluster_first_sector(clus) + offset / meta.sector_size;
+    size_t sec_off = offset % meta.sector_size;
+    size_t pos = 0;                   // The actual number of bytes already written
+
+    // Partial first sector: read -> modify -> write
+    if(sec_off != 0 || size < meta.sector_size) {
+        int ret = sector_read(sec, sector_buffer);
+        if(ret < 0) {
+            return ret;
+        }
+        pos = min(size, meta.sector_size - sec_off);
+        memcpy(sector_buffer + sec_off, data, pos);
+        ret = sector_write(sec, sector_buffer);
+        if(ret < 0) {
+            return ret;
+        }
+        sec++;
+    }
+    // Whole sectors are written from `data` with one request, no read needed
+    size_t nsec = (size - pos) / meta.sector_size;
+    if(nsec > 0) {
+        int ret = sectors_write(sec, nsec, data + pos);
+        if(ret < 0) {
+            return ret;
+        }
+        pos += nsec * meta.sector_size;
+        sec += nsec;
+    }
+    // Partial last sector: read -> modify -> write
+    if(pos < size) {
+        int ret = sector_read(sec, sector_buffer);
+        if(ret < 0) {
+            return ret;
+        }
+        memcpy(sector_buffer, data + pos, size - pos);
+        ret = sector_write(sec, sector_buffer);
+        if(ret < 0) {
+            return ret;
+        }
+    }
+    return size;
+}
+
+/**
+ * @brief Write data from `data` into cluster identified by `clus` starting
+ *        at `offset`.
+ *        Note that size+offset <= cluster size
+ * 
+ * @param clus      : Cluster number where the data is to be written
+ * @param data      : Data to be written
+ * @param size      : Size of data to be written (in bytes)
+ * @param offset    : Offset within the cluster where the data writing starts
+ * @return <ssize_t>: Return number of bytes written on success, -ENOERROR on failure.
+ */
+ssize_t write_to_cluster_at_offset(cluster_t clus, off_t offset, const char* data, size_t size) {
+    return write_to_extent_at_offset(clus, 1, offset, data, size);
+}
+
+/**
+ * @brief Grow the cluster chain of the file whose directory entry is `slot`
+ *        to at least `need` clusters, keeping the cached chain in sync.
+ *        The new clusters are not zeroed, the caller fills them up to the
+ *        new end of file.
+ *        If the file had no cluster, `slot->dir.DIR_FstClusLO` is set and
+ *        the caller is responsible for writing the directory entry back.
+ * 
+ * @param slot   : Directory entry of the file
+ * @param chain  : Cached chain of the file, from `chain_index_get()`
+ * @param need   : Number of clusters the file needs
+ * @return <int> : Return 0 on success, -ENOERROR on failure.
+ */
+int file_reserve_clusters(DirEntrySlot* slot, ChainIndex* chain, size_t need) {
+    if(need <= chain->nclusters) {
+        return 0;
+    }
+    cluster_t last = chain->nclusters > 0 ? chain->clusters[chain->nclusters - 1] : CLUSTER_FREE;
+    cluster_t first_new;
+    int ret = alloc_chain(need - chain->nclusters, last, false, &chain->wb_reserved, &first_new);
+    if(ret < 0) {
+        return ret;
+    }
+    if(chain->nclusters == 0) {
+        slot->dir.DIR_FstClusLO = first_new;
+        chain->first = first_new;
+    }
+    return chain_index_extend(chain, first_new);
+}
+
+/**
+ * @brief Write `size` bytes of `data` at `offset` straight to the clusters of
+ *        the file, allocating the missing ones, and update `DIR_FileSize`.
+ *        Note that offset <= DIR_FileSize, and the delayed appends of the
+ *        file were flushed before, or are `data` itself.
+ * 
+ * @param slot    : Directory entry of the file
+ * @param chain   : Cached chain of the file, from `chain_index_get()`
+ * @return <int>  : Return number of bytes written on success, -ENOERROR on failure.
+ */
+int file_write_extents(DirEntrySlot* slot, ChainIndex* chain, const char *data, size_t size, off_t offset) {
+    DIR_ENTRY* dir = &(slot->dir);
+    size_t end = offset + size;
+    int ret = file_reserve_clusters(slot, chain, (end + meta.cluster_size - 1) / meta.cluster_size);
+    if(ret < 0) {
+        return ret;
+    }
+
+    // Write extent by extent, like `file_read()`
+    size_t i = offset / meta.cluster_size;      // Index of the cluster holding `offset`
+    size_t clus_off = offset % meta.cluster_size;
+    size_t p = 0;                               // Bytes written so far
+    while(p < size) {
+        size_t nclus = 1;
+        while(i + nclus < chain->nclusters && chain->clusters[i + nclus] == chain->clusters[i] + nclus
+                && nclus * meta.cluster_size - clus_off < size - p) {
+            nclus++;
+        }
+        size_t to_write = min(size - p, nclus * meta.cluster_size - clus_off);
+        ssize_t written = write_to_extent_at_offset(chain->clusters[i], nclus, clus_off, data + p, to_write);
+        if(written < 0) {
+            return written;
+        }
+        p += written;
+        clus_off = 0;
+        i += nclus;
+    }
+
+    // Update the directory entry file size if needed
+    if(end > dir->DIR_FileSize) {
+        dir->DIR_FileSize = end;
+        ret = dir_entry_write(*slot);
+        if(ret < 0) {
             return ret;
         }
-        DIR_ENTRY* entry = (DIR_ENTRY*)(sector_buffer + (i % (meta.sector_size / DIR_ENTRY_SIZE)) * DIR_ENTRY_SIZE);
-        if (entry->DIR_Name[0] != NAME_FREE && entry->DIR_Name[0] != NAME_DELETED) {
-            if (memcmp(entry->DIR_Name, ".          ", FAT_NAME_LEN) != 0 &&
-                memcmp(entry->DIR_Name, "..         ", FAT_NAME_LEN) != 0) {
-                return -ENOTEMPTY;
-            }
-        }
     }
+    return p;
+}
 
-    ret = free_clusters(slot.dir.DIR_FstClusLO);
-    if (ret < 0) {
-        return ret;
+/**
+ * @brief Add `size` bytes of `data` to the delayed appends of `chain`, unless
+ *        that would exceed the buffer limits or the free space.
+ * 
+ * @return <bool>: Return true if the data was buffered.
+ */
+bool file_buffer_append(ChainIndex* chain, const DirEntrySlot* slot, const char* data, size_t size) {
+    size_t len = chain->wb_len + size;
+    if(len > WRITE_BUFFER_MAX) {
+        return false;
+    }
+    pthread_mutex_lock(&write_buffer_lock);
+    bool fits = write_buffer_total + size <= WRITE_BUFFER_TOTAL;
+    if(fits) {
+        write_buffer_total += size;
+    }
+    pthread_mutex_unlock(&write_buffer_lock);
+    if(!fits) {
+        return false;
+    }
+    if(len > chain->wb_capacity) {
+        size_t capacity = max(len, min(max(chain->wb_capacity * 2, 4096), WRITE_BUFFER_MAX));
+        char* buffer = realloc(chain->wb_data, capacity);
+        if(buffer == NULL) {
+            pthread_mutex_lock(&write_buffer_lock);
+            write_buffer_total -= size;
+            pthread_mutex_unlock(&write_buffer_lock);
+            return false;
+        }
+        chain->wb_data = buffer;
+        chain->wb_capacity = capacity;
+    }
+
+    // Delayed allocation must not promise space the volume does not have:
+    // reserve the clusters the flush will allocate, net of those of other buffers
+    size_t need = (slot->dir.DIR_FileSize + len + meta.cluster_size - 1) / meta.cluster_size;
+    size_t missing = need > chain->nclusters + chain->wb_reserved ? need - chain->nclusters - chain->wb_reserved : 0;
+    if(missing > 0) {
+        fits = fat_write_lock() == 0;   // Without a complete FAT cache, nothing can be reserved
+        if(fits) {
+            fits = missing <= fat_cache.nfree - fat_cache.reserved;
+            if(fits) {
+                fat_cache.reserved += missing;
+                chain->wb_reserved += missing;
+            }
+            pthread_rwlock_unlock(&fat_lock);
+        }
     }
-    
-    slot.dir.DIR_Name[0] = NAME_DELETED;  // Mark as deleted
-    ret = dir_entry_write(slot);
-    if (ret < 0) {
-        return ret;
+    if(!fits) {
+        pthread_mutex_lock(&write_buffer_lock);
+        write_buffer_total -= size;
+        pthread_mutex_unlock(&write_buffer_lock);
+        return false;
     }
-
-    
-    
-    // ===================================================
-    return 0; // TODO: Please modify the return value.
+    memcpy(chain->wb_data + chain->wb_len, data, size);
+    chain->wb_len = len;
+    return true;
 }
 
 /**
- * @brief Modify the timestamps of the file specified by `path`. This function
- *        is not required for implementation, can be ignored.
+ * @brief Write the delayed appends of the file whose directory entry is
+ *        `slot`: the clusters for its final size are allocated as one chain,
+ *        the data goes out extent by extent and the directory entry is
+ *        written once. Caller holds the file lock.
  * 
- * @param path   : Path of the file whose timestamps are to be modified
- * @param tv     : Timestamps
- * @return <int> 
+ * @param slot   : Directory entry of the file, its size is updated
+ * @param chain  : Cached chain of the file
+ * @return <int> : Return 0 on success, -ENOERROR on failure.
  */
-int fat16_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info* fi) {
-    printf("utimens(path='%s', tv=[%ld.%09ld, %ld.%09ld])\n", path, 
-                tv[0].tv_sec, tv[0].tv_nsec, tv[1].tv_sec, tv[1].tv_nsec);
-    DirEntrySlot slot;
-    DIR_ENTRY* dir = &(slot.dir);
-    int ret = find_entry(path, &slot);
+int file_buffer_flush(DirEntrySlot* slot, ChainIndex* chain) {
+    if(chain->wb_len == 0) {
+        return 0;
+    }
+    // `DIR_FileSize` only moves once everything is written, so after a
+    // failure the buffer is kept and the flush can be tried again
+    int ret = file_write_extents(slot, chain, chain->wb_data, chain->wb_len, slot->dir.DIR_FileSize);
     if(ret < 0) {
         return ret;
     }
+    file_buffer_discard(chain);         // Written, and the reservation is used up
+    return 0;
+}
 
-    time_unix_to_fat(&tv[1], &(dir->DIR_WrtDate), &(dir->DIR_WrtTime), NULL);
-    time_unix_to_fat(&tv[0], &(dir->DIR_LstAccDate), NULL, NULL);
-    ret = dir_entry_write(slot);
+/**
+ * @brief Flush the delayed appends of the file whose directory entry is
+ *        `slot`, if it has any, or report the error of an earlier flush
+ *        that failed when they were evicted. Caller holds the file lock.
+ * 
+ * @return <int>: Return 0 on success, -ENOERROR on failure.
+ */
+int file_sync(DirEntrySlot* slot) {
+    int ret = chain_index_take_error(slot);
     if(ret < 0) {
         return ret;
     }
-    
-    return 0;
+    ChainIndex* c = chain_index_find(slot);
+    if(c == NULL || !c->valid) {
+        return 0;
+    }
+    return file_buffer_flush(slot, c);
 }
 
 /**
- * @brief Write data from `data` into cluster identified by `clus` starting
- *        at `offset`.
- *        Note that size+offset <= cluster size
+ * @brief The body of `fat16_write()`, called with the file locked. Appends
+ *        are only buffered; anything else first flushes the buffer, then
+ *        writes to the clusters.
  * 
- * @param clus      : Cluster number where the data is to be written
- * @param data      : Data to be written
- * @param size      : Size of data to be written (in bytes)
- * @param offset    : Offset within the cluster where the data writing starts
- * @return <ssize_t>: Return number of bytes written on success, -ENOERROR on failure.
+ * @param slot    : Directory entry of the file
+ * @return <int>  : Return number of bytes written on success, -ENOERROR on failure.
  */
-ssize_t write_to_cluster_at_offset(cluster_t clus, off_t offset, const char* data, size_t size) {
-    assert(offset + size <= meta.cluster_size);  // offset + size must not exceed cluster size
-    char sector_buffer[PHYSICAL_SECTOR_SIZE];
-
-    /**
-     * TASK 8.2
-     * TODO:
-     *   Write data into a cluster [~20 lines of code]
-     * Hint:
-     *   Refer to `read_from_cluster_at_offset`.
-     *   Basically, each sector requires a read -> modify -> write process.
-     */
-
-    // ================== Your code here =================
-    size_t sector_size = meta.sector_size;
-    size_t cluster_size = meta.cluster_size;
-    sector_t first_sector = cluster_first_sector(clus);
-    ssize_t total_written = 0;
-
-    while (size > 0) {
-        sector_t sector = first_sector + (offset / sector_size);
-        size_t sector_offset = offset % sector_size;
-        size_t to_write = min(size, sector_size - sector_offset);
-
-        int ret = sector_read(sector, sector_buffer);
-        if (ret < 0) {
-            return ret;
-        }
-
-        memcpy(sector_buffer + sector_offset, data, to_write);
-        ret = sector_write(sector, sector_buffer);
-        if (ret < 0) {
-            return ret;
-        }
+int file_write(DirEntrySlot* slot, const char *data, size_t size, off_t offset) {
+    DIR_ENTRY* dir = &(slot->dir);
+    if(attr_is_directory(dir->DIR_Attr)) {
+        return -EISDIR;
+    }
+    ChainIndex* chain;
+    int ret = chain_index_get(slot, &chain);
+    if(ret < 0) {
+        return ret;
+    }
+    if(offset > dir->DIR_FileSize + chain->wb_len) {
+        return -EINVAL;
+    }
+    if(size == 0) {
+        return 0;
+    }
 
-        data += to_write;
-        size -= to_write;
-        offset += to_write;
-        total_written += to_write;
+    if(offset == dir->DIR_FileSize + chain->wb_len && file_buffer_append(chain, slot, data, size)) {
+        return size;
     }
-    
-    
-    // ===================================================
-    return total_written; // TODO: Please modify the return value.
+    ret = file_buffer_flush(slot, chain);
+    if(ret < 0) {
+        return ret;
+    }
+    if(offset == dir->DIR_FileSize && file_buffer_append(chain, slot, data, size)) {
+        return size;                    // Fits now that the buffer is empty
+    }
+    return file_write_extents(slot, chain, data, size, offset);
 }
 
 /**
@@ -1362,7 +3359,7 @@ ssize_t write_to_cluster_at_offset(cluster_t clus, off_t offset, const char* dat
  * @param data    : Data to be written
  * @param size    : Length of data to be written
  * @param offset  : Offset within the file where data writing starts (in bytes)
- * @param fi      : This parameter can be ignored here.
+ * @param fi      : The open file, from `fat16_open()`
  * @return <int>  : Return number of bytes written on success, -ENOERROR on failure.
  */
 int fat16_write(const char *path, const char *data, size_t size, off_t offset,
@@ -1373,103 +3370,217 @@ int fat16_write(const char *path, const char *data, size_t size, off_t offset,
     }
 
     DirEntrySlot slot;
-    DIR_ENTRY* dir = &(slot.dir);
-    int ret = find_entry(path, &slot);
+    int ret = handle_lock(path, fi, &slot);
     if(ret < 0) {
         return ret;
     }
+    ret = file_write(&slot, data, size, offset);
+    file_unlock(&slot);
+    return ret;
+}
+
+/**
+ * @brief Write the next `size` bytes of `src` at `offset` within the extent
+ *        of `nclus` clusters starting at `clus`. Whole sectors are moved
+ *        from `src` to the image by `sectors_write_buf()`; only a partial
+ *        first and last sector go through memory, read-modify-write.
+ * 
+ * @return <int>: Return 0 on success, -ENOERROR on failure.
+ */
+int write_buf_to_extent(cluster_t clus, size_t nclus, off_t offset, struct fuse_bufvec* src, size_t size) {
+    char sector_buffer[MAX_LOGICAL_SECTOR_SIZE];
+    while(size > 0) {
+        size_t sec_off = offset % meta.sector_size;
+        size_t n = sec_off != 0 || size < meta.sector_size
+                ? min(size, meta.sector_size - sec_off)         // Partial sector
+                : size / meta.sector_size * meta.sector_size;   // Whole sectors
+        int ret;
+        if(n % meta.sector_size != 0 || sec_off != 0) {
+            struct fuse_bufvec mem = FUSE_BUFVEC_INIT(n);
+            mem.buf[0].mem = sector_buffer;
+            ssize_t copied = fuse_buf_copy(&mem, src, 0);
+            ret = copied != (ssize_t)n ? -EIO : write_to_extent_at_offset(clus, nclus, offset, sector_buffer, n);
+        } else {
+            ret = sectors_write_buf(cluster_first_sector(clus) + offset / meta.sector_size, n / meta.sector_size, src);
+        }
+        if(ret < 0) {
+            return ret;
+        }
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief The body of `fat16_write_buf()`, called with the file locked.
+ *        Appends the delayed-append buffer can take, and writes smaller than
+ *        a sector, are copied into memory and handled by `file_write()`.
+ *        Others are written extent by extent from `src`.
+ * 
+ * @param slot    : Directory entry of the file
+ * @param src     : Data to be written
+ * @param offset  : Offset within the file where data writing starts (in bytes)
+ * @return <int>  : Return number of bytes written on success, -ENOERROR on failure.
+ */
+int file_write_buf(DirEntrySlot* slot, struct fuse_bufvec* src, off_t offset) {
+    DIR_ENTRY* dir = &(slot->dir);
     if(attr_is_directory(dir->DIR_Attr)) {
         return -EISDIR;
     }
-    if(offset > dir->DIR_FileSize) {
+    ChainIndex* chain;
+    int ret = chain_index_get(slot, &chain);
+    if(ret < 0) {
+        return ret;
+    }
+    size_t size = fuse_buf_size(src);
+    if(offset > dir->DIR_FileSize + chain->wb_len) {
         return -EINVAL;
     }
-    if(size == 0) {
-        return 0;
+
+    bool buffered = offset == dir->DIR_FileSize + chain->wb_len && chain->wb_len + size <= WRITE_BUFFER_MAX;
+    if(buffered || size < meta.sector_size) {
+        char* data = malloc(max(size, 1));
+        if(data == NULL) {
+            return -ENOMEM;
+        }
+        struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+        mem.buf[0].mem = data;
+        ssize_t copied = fuse_buf_copy(&mem, src, 0);
+        ret = copied != (ssize_t)size ? -EIO : file_write(slot, data, size, offset);
+        free(data);
+        return ret;
     }
 
-    /**
-     * TASK 8.1
-     * TODO:
-     *   Write data into the file, allocate new clusters if necessary
-     *   [~50 lines of code]
-     * Hint: None. You are on your own.
-     * 
-     */
-    // ================== Your code here =================
-     
-    size_t cluster_size = meta.cluster_size;
-    cluster_t current_cluster = dir->DIR_FstClusLO;
-    cluster_t prev_cluster = 0;
-    size_t bytes_written = 0;
-
-    // Navigate to the right cluster
-    off_t cluster_offset = offset / cluster_size;
-    size_t cluster_inner_offset = offset % cluster_size;
-
-    while (cluster_offset > 0 && current_cluster >= CLUSTER_MIN && current_cluster < CLUSTER_END_BOUND) {
-        prev_cluster = current_cluster;
-        ret = read_fat_entry(current_cluster);
-        if (ret < 0) {
+    ret = file_buffer_flush(slot, chain);
+    if(ret < 0) {
+        return ret;
+    }
+    size_t end = offset + size;
+    ret = file_reserve_clusters(slot, chain, (end + meta.cluster_size - 1) / meta.cluster_size);
+    if(ret < 0) {
+        return ret;
+    }
+    // Write extent by extent, like `file_write_extents()`
+    size_t i = offset / meta.cluster_size;
+    size_t clus_off = offset % meta.cluster_size;
+    for(size_t p = 0; p < size; ) {
+        size_t nclus = 1;
+        while(i + nclus < chain->nclusters && chain->clusters[i + nclus] == chain->clusters[i] + nclus
+                && nclus * meta.cluster_size - clus_off < size - p) {
+            nclus++;
+        }
+        size_t to_write = min(size - p, nclus * meta.cluster_size - clus_off);
+        ret = write_buf_to_extent(chain->clusters[i], nclus, clus_off, src, to_write);
+        if(ret < 0) {
+            return ret;
+        }
+        p += to_write;
+        clus_off = 0;
+        i += nclus;
+    }
+    if(end > dir->DIR_FileSize) {
+        dir->DIR_FileSize = end;
+        ret = dir_entry_write(*slot);
+        if(ret < 0) {
             return ret;
         }
-        cluster_offset--;
     }
+    return size;
+}
 
-    // Write data to clusters
-    while (size > 0) {
-        if (current_cluster < CLUSTER_MIN || current_cluster >= CLUSTER_END_BOUND) {
-            // Allocate new clusters if necessary
-            size_t clusters_needed = (size + cluster_size - 1) / cluster_size;
-            cluster_t first_new_cluster;
-            ret = alloc_clusters(clusters_needed, &first_new_cluster);
-            if (ret < 0) {
-                return ret;
-            }
+/**
+ * @brief Write the data of `buf` to the file specified by `path` starting at
+ *        `offset`, like `fat16_write()`, but without copying whole sectors
+ *        through our memory: FUSE moves them into the image file, by splice
+ *        when the data arrives in a pipe.
+ * 
+ * @param path    : Path of the file where data is to be written
+ * @param buf     : Data to be written
+ * @param offset  : Offset within the file where data writing starts (in bytes)
+ * @param fi      : The open file, from `fat16_open()`
+ * @return <int>  : Return number of bytes written on success, -ENOERROR on failure.
+ */
+int fat16_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                    struct fuse_file_info *fi) {
+    printf("write_buf(path='%s', offset=%ld, size=%lu)\n", path, offset, fuse_buf_size(buf));
+    if(path_is_root(path)) {
+        return -EISDIR;
+    }
 
-            if (prev_cluster) {
-                ret = write_fat_entry(prev_cluster, first_new_cluster);
-                if (ret < 0) {
-                    return ret;
-                }
-            } else {
-                dir->DIR_FstClusLO = first_new_cluster;
-            }
-            current_cluster = first_new_cluster;
-        }
+    DirEntrySlot slot;
+    int ret = handle_lock(path, fi, &slot);
+    if(ret < 0) {
+        return ret;
+    }
+    ret = file_write_buf(&slot, buf, offset);
+    file_unlock(&slot);
+    return ret;
+}
 
-        size_t to_write = min(size, cluster_size - cluster_inner_offset);
-        ssize_t written = write_to_cluster_at_offset(current_cluster, cluster_inner_offset, data, to_write);
-        if (written < 0) {
-            return written;
-        }
 
-        data += written;
-        size -= written;
-        offset += written;
-        bytes_written += written;
-        cluster_inner_offset = 0;
+/**
+ * @brief The body of `fat16_truncate()`, called with the file locked.
+ * 
+ * @param slot   : Directory entry of the file
+ * @param size   : New file size
+ * @return <int> : Return 0 on success, -ENOERROR on failure.
+ */
+int file_truncate(DirEntrySlot* slot, off_t size) {
+    DIR_ENTRY* dir = &(slot->dir);
+    if(attr_is_directory(dir->DIR_Attr)) {
+        return -EISDIR;
+    }
 
-        // Move to the next cluster if necessary
-        if (size > 0) {
-            prev_cluster = current_cluster;
-            ret = read_fat_entry(current_cluster);
-            if (ret < 0) {
+    ChainIndex* chain;
+    int ret = chain_index_get(slot, &chain);
+    if(ret == 0) {
+        ret = file_buffer_flush(slot, chain);
+    }
+    if(ret < 0) {
+        return ret;
+    }
+    size_t old_size = dir->DIR_FileSize;
+    if(old_size == size) {
+        return 0;
+    }
+    size_t need_clus = (size + meta.cluster_size - 1) / meta.cluster_size;
+    if(size > old_size) {
+        ret = file_reserve_clusters(slot, chain, need_clus);
+        if(ret < 0) {
+            return ret;
+        }
+        // Neither the clusters past the old end of file nor the new ones
+        // are zeroed: zero exactly the range the file grows by
+        size_t pos = old_size;
+        while(pos < size) {
+            size_t clus_off = pos % meta.cluster_size;
+            size_t n = min(size - pos, meta.cluster_size - clus_off);
+            ssize_t ret = write_to_cluster_at_offset(chain->clusters[pos / meta.cluster_size], clus_off, zero_cluster, n);
+            if(ret < 0) {
                 return ret;
             }
+            pos += n;
         }
-    }
-
-    // Update the directory entry file size if needed
-    if (offset > dir->DIR_FileSize) {
-        dir->DIR_FileSize = offset;
-        ret = dir_entry_write(slot);
-        if (ret < 0) {
+    } else if(need_clus < chain->nclusters) {
+        if(need_clus == 0) {
+            ret = free_clusters(dir->DIR_FstClusLO);
+            dir->DIR_FstClusLO = CLUSTER_FREE;
+        } else {
+            ret = write_fat_entry(chain->clusters[need_clus - 1], CLUSTER_END);
+            if(ret == 0) {
+                ret = free_clusters(chain->clusters[need_clus]);
+            }
+        }
+        if(ret < 0) {
+            chain_index_invalidate(slot);
             return ret;
         }
     }
+    chain_index_invalidate(slot);
 
-    return bytes_written;
+    dir->DIR_FileSize = size;
+    return dir_entry_write(*slot);
 }
 
 /**
@@ -1484,6 +3595,7 @@ int fat16_write(const char *path, const char *data, size_t size, off_t offset,
  * 
  * @param path   : Path of the file whose size is to be changed
  * @param size   : New file size
+ * @param fi     : The open file for ftruncate(), NULL otherwise
  * @return <int> : Return 0 on success, -ENOERROR on failure.
  */
 int fat16_truncate(const char *path, off_t size, struct fuse_file_info* fi) {
@@ -1493,76 +3605,162 @@ int fat16_truncate(const char *path, off_t size, struct fuse_file_info* fi) {
     }
 
     DirEntrySlot slot;
-    DIR_ENTRY* dir = &(slot.dir);
-    int ret = find_entry(path, &slot);
+    int ret = handle_lock(path, fi, &slot);
     if(ret < 0) {
         return ret;
     }
-    if(attr_is_directory(dir->DIR_Attr)) {
+    ret = file_truncate(&slot, size);
+    file_unlock(&slot);
+    return ret;
+}
+
+
+/**
+ * @brief Open the file specified by `path`: its directory entry is looked up
+ *        once and kept in a `FileHandle` stored in `fi->fh`.
+ * 
+ * @param path   : Path of the file
+ * @param fi     : File info passed by FUSE, receives the handle
+ * @return <int> : Return 0 on success, -ENOERROR on failure.
+ */
+int fat16_open(const char *path, struct fuse_file_info *fi) {
+    printf("open(path='%s')\n", path);
+    if(path_is_root(path)) {
         return -EISDIR;
     }
+    DirEntrySlot slot;
+    int ret = file_lock(path, &slot);   // So that the file cannot be unlinked before the handle is listed
+    if(ret < 0) {
+        return ret;
+    }
+    FileHandle* fh = NULL;
+    if(attr_is_directory(slot.dir.DIR_Attr)) {
+        ret = -EISDIR;
+    } else if((fh = malloc(sizeof(FileHandle))) == NULL) {
+        ret = -ENOMEM;
+    } else {
+        size_t h = chain_index_set(&slot);
+        fh->sector = slot.sector;
+        fh->offset = slot.offset;
+        fh->parent = slot.parent;
+        fh->unlinked = false;
+        fh->next = open_files[h];
+        open_files[h] = fh;
+        fi->fh = (uintptr_t)fh;
+    }
+    file_unlock(&slot);
+    return ret;
+}
 
-    size_t old_size = dir->DIR_FileSize;
-    if(old_size == size) {
-        return 0;
-    } else if(size > old_size) {
-        size_t need_clus = (size + meta.cluster_size - 1) / meta.cluster_size;
-        cluster_t clus = dir->DIR_FstClusLO;
-        cluster_t last_clus = 0;
-        while(is_cluster_inuse(clus)) {
-            last_clus = clus;
-            need_clus --;
-            clus = read_fat_entry(clus);
-        }
-
-        cluster_t new;
-        int ret = alloc_clusters(need_clus, &new);
-        if(ret < 0) {
-            return ret;
-        }
-        ret = write_fat_entry(last_clus, new);
+/**
+ * @brief Make the data of the file specified by `path` durable by writing
+ *        its delayed appends and all dirty cached sectors to the image.
+ * 
+ * @param path     : Path of the file
+ * @param datasync : Ignored, metadata is flushed together with data
+ * @param fi       : The open file, from `fat16_open()`
+ * @return <int>   : Return 0 on success, -ENOERROR on failure.
+ */
+int fat16_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    printf("fsync(path='%s', datasync=%d)\n", path, datasync);
+    DirEntrySlot slot;
+    int ret = handle_lock(path, fi, &slot);
+    if(ret < 0) {
+        return ret;
+    }
+    ret = file_sync(&slot);
+    file_unlock(&slot);
+    if(ret < 0) {
+        return ret;
+    }
+    return disk_flush();
+}
 
-        if(last_clus == 0) {
-            dir->DIR_FstClusLO = new;
-        }
-    } else if(size < old_size) {
-        size_t need_clus = (size + meta.cluster_size - 1) / meta.cluster_size;
-        cluster_t clus = dir->DIR_FstClusLO;
-        cluster_t last_clus = 0;
-        while(need_clus > 0) {
-            need_clus --;
-            last_clus = clus;
-            clus = read_fat_entry(clus);
-        }
-        if(last_clus == 0) {
-            dir->DIR_FstClusLO = CLUSTER_FREE;
-        } else {
-            int ret;
-            ret = free_clusters(clus);
-            if(ret < 0) {
-                return ret;
-            }
-            ret = write_fat_entry(last_clus, CLUSTER_END);
-            if(ret < 0) {
-                return ret;
-            }
-        }
+/**
+ * @brief Write the delayed appends of the file specified by `path`. Called
+ *        on every close() of a file descriptor.
+ * 
+ * @param path   : Path of the file
+ * @param fi     : The open file, from `fat16_open()`
+ * @return <int> : Return 0 on success, -ENOERROR on failure.
+ */
+int fat16_flush(const char *path, struct fuse_file_info *fi) {
+    printf("flush(path='%s')\n", path);
+    DirEntrySlot slot;
+    int ret = handle_lock(path, fi, &slot);
+    if(ret == -ENOENT && fi->fh != 0) {
+        return 0;                       // Unlinked while open, nothing left to write
     }
+    if(ret < 0) {
+        return ret;
+    }
+    ret = file_sync(&slot);
+    file_unlock(&slot);
+    return ret;
+}
 
-    dir->DIR_FileSize = size;
-    dir_entry_write(slot);
+/**
+ * @brief Release an open file: its delayed appends are written, like on
+ *        flush, and its handle is freed.
+ * 
+ * @param path   : Path of the file
+ * @param fi     : The open file, from `fat16_open()`
+ * @return <int> : Return 0 on success, -ENOERROR on failure.
+ */
+int fat16_release(const char *path, struct fuse_file_info *fi) {
+    printf("release(path='%s')\n", path);
+    int ret = fat16_flush(path, fi);
+    FileHandle* fh = (FileHandle*)(uintptr_t)fi->fh;
+    if(fh != NULL) {
+        DirEntrySlot slot = { .sector = fh->sector, .offset = fh->offset };
+        size_t h = chain_index_set(&slot);
+        pthread_mutex_lock(&file_locks[h]);
+        FileHandle** p = &open_files[h];
+        while(*p != fh) {
+            p = &(*p)->next;
+        }
+        *p = fh->next;
+        pthread_mutex_unlock(&file_locks[h]);
+        free(fh);
+    }
+    fi->fh = 0;
+    return ret;
+}
 
+/**
+ * @brief Report the size and free space of the file system.
+ * 
+ * @param path   : Ignored
+ * @param stbuf  : Output parameter to store the file system statistics
+ * @return <int> : Return 0.
+ */
+int fat16_statfs(const char *path, struct statvfs *stbuf) {
+    printf("statfs(path='%s')\n", path);
+    memset(stbuf, 0, sizeof(struct statvfs));
+    stbuf->f_bsize = meta.cluster_size;
+    stbuf->f_frsize = meta.cluster_size;
+    stbuf->f_blocks = meta.clusters;
+    if(fat_cache_wait() == 0) {     // If the FAT could not be loaded, nothing can be allocated
+        pthread_rwlock_rdlock(&fat_lock);
+        stbuf->f_bfree = fat_cache.nfree - fat_cache.reserved;     // Kept up to date by `write_fat_entry()`
+        pthread_rwlock_unlock(&fat_lock);
+    }
+    stbuf->f_bavail = stbuf->f_bfree;
+    stbuf->f_namemax = FAT_NAME_BASE_LEN + 1 + FAT_NAME_EXT_LEN;
     return 0;
 }
 
-
 struct fuse_operations fat16_oper = {
     .init = fat16_init,         // File system initialization
     .destroy = fat16_destroy,   // File system termination
     .getattr = fat16_getattr,   // Get file attributes
 
+    .opendir = fat16_opendir,   // Open directory and read its listing
     .readdir = fat16_readdir,   // Read directory
+    .releasedir = fat16_releasedir, // Free directory listing
+    .open = fat16_open,         // Open file, resolving its path once
     .read = fat16_read,         // Read file
+    .read_buf = fat16_read_buf, // Read file as ranges of the image, for splicing
 
     .mknod = fat16_mknod,       // Create file
     .unlink = fat16_unlink,     // Delete file
@@ -1572,5 +3770,10 @@ struct fuse_operations fat16_oper = {
     .rmdir = fat16_rmdir,       // Delete directory
 
     .write = fat16_write,       // Write to file
-    .truncate = fat16_truncate  // Change file size
+    .write_buf = fat16_write_buf,   // Write to file from FUSE buffers, for splicing
+    .truncate = fat16_truncate, // Change file size
+    .fsync = fat16_fsync,       // Flush cached writes
+    .flush = fat16_flush,       // Write delayed appends on close
+    .release = fat16_release,   // Write delayed appends when the file is released
+    .statfs = fat16_statfs      // File system statistics
 };
@@ -61,6 +61,7 @@ typedef uint32_t DWORD;
 #define CLUSTER_END_BOUND   0xFFF8u         // End Bound (文件结束簇号界限，大于等于该数的簇号都被视为文件结束)
 
 #define DEFAULT_IMAGE       "fat16.img"
+#define DEFAULT_CACHE_MB    16              // Default size of the sector cache (MiB)
 
 #define min(x, y) (((x) < (y)) ? (x) : (y))
 #define max(x, y) (((x) > (y)) ? (x) : (y))
@@ -115,7 +116,25 @@ enum FindResult {
     FIND_FULL  = 2
 };
 
+/* File system options, passed to `fat16_init()` as FUSE private data */
+typedef struct {
+    bool prewarm;           // Read and index all metadata at mount
+    bool lazy;              // Load metadata in the background after mount
+} FsOptions;
+
+/* Disk layer (fat16_fixed.c). Functions return 0 on success, -EIO on failure.
+   Sectors are logical sectors, 512 bytes until `disk_set_sector_size()`. */
+int disk_set_sector_size(size_t size);  // Use `size`-byte sectors (BPB_BytsPerSec), before `disk_start()`
 int sector_read(sector_t sec_num, void *buffer);
 int sector_write(sector_t sec_num, const void *buffer);
+int sectors_read(sector_t first, size_t count, void *buffer);          // Read `count` consecutive sectors
+int sectors_write(sector_t first, size_t count, const void *buffer);   // Write `count` consecutive sectors
+int sectors_write_buf(sector_t first, size_t count, struct fuse_bufvec *src);  // Write `count` sectors from `src`, bypassing the cache
+const void *disk_map(sector_t first, size_t count);  // Address of mapped sectors (--mmap), NULL if not mapped
+void disk_prefetch(sector_t first, size_t count);    // Read sectors into the cache in the background
+int disk_fd(sector_t first, size_t count, off_t *pos); // Image fd to read the sectors from at `*pos`, -1 if they must be read through the cache
+int disk_flush();       // Write all dirty cached sectors to the image
+void disk_start();      // Start background workers, called once the file system is mounted
+void disk_stop();       // Stop background workers and flush, called on unmount
 
 #endif
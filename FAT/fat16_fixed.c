@@ -1,19 +1,46 @@
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
 #include <pthread.h>
 #include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include "fat16.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024            // Linux limit on vectors per preadv()/pwritev()
+#endif
+
 static int fd;
+static char *image_map;         // The whole image mapped with --mmap, or NULL
+
+/* How a simulated seek takes its time:
+     spin:    busy-wait, exact but burns a core for every seek.
+     sleep:   sleep, spinning only for the last SEEK_SPIN_TAIL_US.
+     virtual: no delay at all, the seek time is only accounted. */
+enum SeekMode {
+    SEEK_MODE_SPIN = 0,
+    SEEK_MODE_SLEEP,
+    SEEK_MODE_VIRTUAL
+};
+static const char *seek_mode_names[] = { "spin", "sleep", "virtual" };
+
+#define SEEK_SPIN_TAIL_US 50    // Sleeps overshoot by about this much, spin for the rest
 
 struct disk_info {
     uint64_t seek_time_us;      // The time it takes to seek one track
+    enum SeekMode seek_mode;
+    uint64_t seeks;             // Number of simulated seeks
+    uint64_t seek_total_us;     // Simulated seek time, in all modes
+    size_t sector_size;         // Logical sector size, the unit of all sector numbers and transfers
     long dist_size;
     long dist_sectors;
     long last_track;
     long total_track;
 };
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;      // Protects the sector cache
 static struct disk_info di;
 
 void busywait(long us) {
@@ -32,74 +59,1375 @@ void busywait(long us) {
     }
 }
 
+/* Wait `us` microseconds: sleep until shortly before the end, then spin so
+   the wait is still accurate to a few microseconds. */
+static void sleepwait(long us) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(us > SEEK_SPIN_TAIL_US) {
+        struct timespec wake = end;
+        long ns = wake.tv_nsec + (us - SEEK_SPIN_TAIL_US) * 1000;
+        wake.tv_sec += ns / 1000000000;
+        wake.tv_nsec = ns % 1000000000;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+    }
+    long ns = end.tv_nsec + us * 1000;
+    end.tv_sec += ns / 1000000000;
+    end.tv_nsec = ns % 1000000000;
+    struct timespec t;
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &t);
+    } while(t.tv_sec < end.tv_sec || (t.tv_sec == end.tv_sec && t.tv_nsec < end.tv_nsec));
+}
+
+/* Track of logical sector `sec`; tracks are made of physical sectors. */
+static long sector_track(sector_t sec) {
+    return sec * (di.sector_size / PHYSICAL_SECTOR_SIZE) / SEC_PER_TRACK;
+}
+
+/* Move the simulated head to `sec`. Only called by the thread dispatching
+   requests, see `sched_submit()`. */
 void seek_to(sector_t sec) {
-    long track = sec / SEC_PER_TRACK;
+    long track = sector_track(sec);
     long delta = labs(track - di.last_track);
-    busywait(delta * di.seek_time_us);
+    long us = delta * di.seek_time_us;
     di.last_track = track;
+    if(us == 0) {
+        return;
+    }
+    di.seeks++;
+    di.seek_total_us += us;
+    switch(di.seek_mode) {
+    case SEEK_MODE_SPIN:
+        busywait(us);
+        break;
+    case SEEK_MODE_SLEEP:
+        sleepwait(us);
+        break;
+    case SEEK_MODE_VIRTUAL:
+        break;
+    }
 }
 
-int sector_read(sector_t sec_num, void *buffer) {
-    if(sec_num >= di.dist_sectors) {
-        printf("read sector %lu error: out of range.\n", sec_num);
-        memset(buffer, 0, PHYSICAL_SECTOR_SIZE);
-        return 1;
+/* Sector cache between the file system and the image file: a hash-indexed
+   LRU of sectors. With write-back enabled, written sectors stay dirty in
+   memory until `disk_flush()`, eviction, or the periodic flusher thread
+   writes them to the image. All fields are protected by `mutex`, but no
+   image I/O is done while holding it: cache misses are read without it, see
+   `cache_read()`, and entries being written to the image are marked `busy`
+   instead, so that they are neither changed, evicted nor dropped until the
+   write is done, see `cache_write_back()`. */
+typedef struct cache_entry {
+    sector_t sec;
+    bool dirty;
+    bool busy;                          // A write of this sector to the image is in flight
+    struct cache_entry *hash_next;      // Next entry in the same hash bucket
+    struct cache_entry *prev, *next;    // LRU list, most recently used first
+    char *data;                         // `di.sector_size` bytes within `cache.data`
+} CacheEntry;
+
+struct sector_cache {
+    CacheEntry *pool;           // All entries, enough for `size` bytes of physical sectors
+    char *data;                 // Sector data of the entries
+    size_t size;                // Bytes of `data`
+    size_t capacity;            // Entries in use at the current sector size
+    size_t used;                // Entries of `pool` handed out so far
+    CacheEntry **buckets;
+    size_t nbuckets;            // Power of two
+    CacheEntry lru;             // Sentinel of the LRU list
+    bool writeback;
+    size_t ndirty;
+    size_t nbusy;
+    uint64_t generation;        // Bumped whenever sector data is written, to the cache or the image
+    uint64_t hits, misses, writebacks;
+};
+static struct sector_cache cache;
+#define CACHE_NO_SECTOR ((sector_t)-1)  // Sector of entries dropped by `cache_drop()`
+
+#define MAX_MAPPED_IMAGE (2L << 30)     // Largest image --mmap maps, the FAT16 limit
+#define CACHE_FLUSH_INTERVAL 5  // Seconds between two runs of the periodic flusher
+
+static pthread_t flusher;
+static bool flusher_running = false;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t cache_idle = PTHREAD_COND_INITIALIZER;   // Broadcast when busy entries are released
+#define CACHE_EVICT_BATCH 64    // Entries looked at to evict, and dirty ones written back to make room
+
+/* Read-ahead requests from `disk_prefetch()`, served by a background thread
+   that reads them into the sector cache. When the queue is full, new
+   requests are dropped: read-ahead is only a hint. All fields are protected
+   by `lock`. */
+#define PREFETCH_QUEUE 64
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // Signalled when a request is queued
+    pthread_t thread;
+    bool running;
+    struct {
+        sector_t first;
+        size_t count;
+    } queue[PREFETCH_QUEUE];
+    size_t head, len;
+    uint64_t requests, sectors, dropped;
+} prefetch = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static size_t cache_hash(sector_t sec) {
+    return (sec * 0x9E3779B97F4A7C15ull >> 32) & (cache.nbuckets - 1);
+}
+
+static void lru_unlink(CacheEntry *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void lru_push_front(CacheEntry *e) {
+    e->next = cache.lru.next;
+    e->prev = &cache.lru;
+    cache.lru.next->prev = e;
+    cache.lru.next = e;
+}
+
+/* Find the entry of `sec` without touching the LRU order. */
+static CacheEntry *cache_peek(sector_t sec) {
+    for(CacheEntry *e = cache.buckets[cache_hash(sec)]; e != NULL; e = e->hash_next) {
+        if(e->sec == sec) {
+            return e;
+        }
     }
-    if(pthread_mutex_lock(&mutex) != 0) {
-        printf("read sector %lu error: lock failed.\n", sec_num);
-        return 1;
+    return NULL;
+}
+
+/* Find the entry of `sec` and mark it as most recently used. */
+static CacheEntry *cache_lookup(sector_t sec) {
+    CacheEntry *e = cache_peek(sec);
+    if(e != NULL) {
+        lru_unlink(e);
+        lru_push_front(e);
     }
-    seek_to(sec_num);
-    ssize_t ret = pread(fd, buffer, PHYSICAL_SECTOR_SIZE, sec_num * PHYSICAL_SECTOR_SIZE);
+    return e;
+}
+
+static void cache_remove_hash(CacheEntry *e) {
+    CacheEntry **p = &cache.buckets[cache_hash(e->sec)];
+    while(*p != e) {
+        p = &(*p)->hash_next;
+    }
+    *p = e->hash_next;
+}
+
+/* Optional io_uring backend for the image file (--io=uring), driven through
+   the raw system calls. Transfers are split into pieces of at most
+   URING_CHUNK bytes that are all submitted with a single io_uring_enter(),
+   so one multi-sector read keeps several requests in flight, and so do
+   concurrent callers. Pieces that lie in the sector cache, which is
+   registered as a fixed buffer, use READ_FIXED/WRITE_FIXED. The image is
+   then opened without O_DSYNC; instead, the pieces of a write are linked
+   to a trailing fdatasync so they are durable before the write returns.
+
+   Any thread may reap completions: whoever waits first blocks in the
+   kernel, the others sleep on `cond` until their pieces are completed.
+
+   The ring is only set up by `disk_start()`, in the process that serves the
+   mount: without -f, fuse_main() forks to go to the background, and a ring
+   created before would be left behind in the parent. */
+#define URING_ENTRIES 64                // Submission queue size
+#define URING_CHUNK (64 * 1024)         // Maximum bytes per request
+
+typedef struct {
+    int pending;                // Requests not completed yet
+    int ret;                    // First error
+} UringWait;
+
+typedef struct {
+    UringWait *wait;
+    size_t len;                 // Bytes expected, 0 for fdatasync
+} UringOp;
+
+/* All fields are protected by `lock`, except the rings shared with the
+   kernel, which are accessed with atomics. */
+static struct {
+    bool requested;             // --io=uring was given
+    const char *image_path;     // To reopen the image without O_DSYNC
+    bool enabled;
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // Broadcast whenever completions were reaped
+    bool reaping;               // A thread waits for completions in the kernel
+    unsigned inflight;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    const char *fixed;          // Registered buffer, or NULL
+    size_t fixed_len;
+    uint64_t submits, requests, max_inflight;
+} uring = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    int ret = syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete, flags, NULL, 0);
+    return ret < 0 ? -errno : ret;
+}
+
+/* Process all completions. Caller holds `uring.lock`. */
+static void uring_reap() {
+    unsigned head = *uring.cq_head;
+    unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    if(head == tail) {
+        return;
+    }
+    for(; head != tail; head++) {
+        struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+        UringOp *op = (UringOp *)(uintptr_t)cqe->user_data;
+        if(cqe->res < 0 || (size_t)cqe->res != op->len) {
+            if(op->wait->ret == 0) {
+                op->wait->ret = -EIO;
+            }
+        }
+        op->wait->pending--;
+        uring.inflight--;
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&uring.cond);
+}
+
+/* Wait until some request completes. Caller holds `uring.lock`, and at least
+   one request is in flight. */
+static void uring_wait_some() {
+    if(uring.reaping) {
+        pthread_cond_wait(&uring.cond, &uring.lock);
+        return;
+    }
+    uring.reaping = true;
+    pthread_mutex_unlock(&uring.lock);
+    int ret = uring_enter(0, 1, IORING_ENTER_GETEVENTS);
+    pthread_mutex_lock(&uring.lock);
+    uring.reaping = false;
+    if(ret < 0 && ret != -EINTR) {
+        printf("io_uring wait error: %s\n", strerror(-ret));
+    }
+    uring_reap();
+    pthread_cond_broadcast(&uring.cond);    // Let another waiter take over reaping
+}
+
+/* Queue one request. Caller holds `uring.lock` and made sure there is room. */
+static void uring_push(uint8_t opcode, const struct iovec *iov, int iovcnt, off_t pos, UringOp *op, bool link) {
+    unsigned tail = *uring.sq_tail;
+    unsigned index = tail & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = pos;
+    sqe->user_data = (uintptr_t)op;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    if(opcode == IORING_OP_FSYNC) {
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    } else if(opcode == IORING_OP_READ_FIXED || opcode == IORING_OP_WRITE_FIXED) {
+        sqe->addr = (uintptr_t)iov->iov_base;
+        sqe->len = iov->iov_len;
+        sqe->buf_index = 0;
+    } else {
+        sqe->addr = (uintptr_t)iov;
+        sqe->len = iovcnt;
+    }
+    uring.sq_array[index] = index;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Split `iov` into pieces of at most URING_CHUNK bytes and IOV_MAX vectors.
+   `pieces` receives the vectors of each piece, back to back, and `ops` and
+   `counts` one entry per piece. Returns the number of pieces. */
+static size_t uring_split(const struct iovec *iov, int iovcnt, struct iovec *pieces, UringOp *ops, int *counts) {
+    size_t n = 0, taken = 0;
+    int i = 0;
+    while(i < iovcnt) {
+        size_t len = 0;
+        int cnt = 0;
+        while(i < iovcnt && len < URING_CHUNK && cnt < IOV_MAX) {
+            size_t part = min(iov[i].iov_len - taken, URING_CHUNK - len);
+            pieces->iov_base = (char *)iov[i].iov_base + taken;
+            pieces->iov_len = part;
+            pieces++;
+            cnt++;
+            len += part;
+            taken += part;
+            if(taken == iov[i].iov_len) {
+                taken = 0;
+                i++;
+            }
+        }
+        ops[n].len = len;
+        counts[n++] = cnt;
+    }
+    return n;
+}
+
+/* Transfer like `image_transfer()`, through the ring. The pieces go out in
+   rounds that fit the queue; each write round ends with a linked fdatasync.
+   Returns -EIO if a piece fails or the kernel does not take a round. */
+static int uring_rw(bool write, sector_t first, const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for(int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    size_t maxpieces = total / URING_CHUNK + iovcnt + 1;
+    struct iovec *pieces = malloc((total / URING_CHUNK + 2 * iovcnt + 1) * sizeof(struct iovec));
+    UringOp *ops = malloc((maxpieces + 1) * sizeof(UringOp));
+    int *counts = malloc(maxpieces * sizeof(int));
+    if(pieces == NULL || ops == NULL || counts == NULL) {
+        free(pieces);
+        free(ops);
+        free(counts);
+        return -ENOMEM;
+    }
+    size_t n = uring_split(iov, iovcnt, pieces, ops, counts);
+
+    UringWait wait = { 0, 0 };
+    off_t pos = first * di.sector_size;
+    struct iovec *piece = pieces;
+    size_t round = write ? URING_ENTRIES - 1 : URING_ENTRIES;
+    pthread_mutex_lock(&uring.lock);
+    for(size_t done = 0; done < n && wait.ret == 0; ) {
+        size_t k = min(round, n - done);
+        unsigned need = k + (write ? 1 : 0);
+        while(uring.inflight + need > URING_ENTRIES) {
+            uring_wait_some();
+        }
+        for(size_t j = done; j < done + k; j++) {
+            ops[j].wait = &wait;
+            const char *base = piece->iov_base;
+            bool fixed = counts[j] == 1 && uring.fixed != NULL &&
+                         base >= uring.fixed && base + piece->iov_len <= uring.fixed + uring.fixed_len;
+            uint8_t opcode = fixed ? (write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED)
+                                   : (write ? IORING_OP_WRITEV : IORING_OP_READV);
+            uring_push(opcode, piece, counts[j], pos, &ops[j], write);
+            pos += ops[j].len;
+            piece += counts[j];
+        }
+        if(write) {
+            ops[n].wait = &wait;
+            ops[n].len = 0;
+            uring_push(IORING_OP_FSYNC, NULL, 0, 0, &ops[n], false);
+        }
+        wait.pending += need;
+        uring.inflight += need;
+        uring.max_inflight = max(uring.max_inflight, uring.inflight);
+        uring.requests += need;
+        uring.submits++;
+        int ret = uring_enter(need, 0, 0);
+        if(ret != (int)need) {
+            // Take back the requests the kernel did not consume, wait for the others and fail
+            unsigned taken = ret > 0 ? ret : 0;
+            printf("io_uring submit error: %s\n", ret < 0 ? strerror(-ret) : "short submit");
+            __atomic_store_n(uring.sq_tail, *uring.sq_tail - (need - taken), __ATOMIC_RELEASE);
+            wait.pending -= need - taken;
+            uring.inflight -= need - taken;
+            wait.ret = -EIO;
+        }
+        while(wait.pending > 0) {
+            uring_reap();
+            if(wait.pending > 0) {
+                uring_wait_some();
+            }
+        }
+        done += k;
+    }
+    pthread_mutex_unlock(&uring.lock);
+    free(pieces);
+    free(ops);
+    free(counts);
+    return wait.ret;
+}
+
+/* Set up the ring and register `fixed` as buffer. Returns false if io_uring
+   is unavailable, in which case the synchronous backend is used. */
+static bool uring_init(const void *fixed, size_t fixed_len) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if(uring.fd < 0) {
+        fprintf(stderr, "io_uring setup failed: %s, using synchronous I/O\n", strerror(errno));
+        return false;
+    }
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_len = cq_len = max(sq_len, cq_len);
+    }
+    char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if(sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+    }
+    uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if(sq == MAP_FAILED || cq == MAP_FAILED || uring.sqes == MAP_FAILED) {
+        fprintf(stderr, "io_uring mmap failed: %s, using synchronous I/O\n", strerror(errno));
+        close(uring.fd);
+        return false;
+    }
+    uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    if(fixed != NULL) {
+        struct iovec buf = { (void *)fixed, fixed_len };
+        if(syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, &buf, 1) == 0) {
+            uring.fixed = fixed;
+            uring.fixed_len = fixed_len;
+        } else {
+            fprintf(stderr, "io_uring buffer registration failed: %s, cached sectors use vectored I/O\n",
+                    strerror(errno));
+        }
+    }
+    uring.enabled = true;
+    return true;
+}
+
+/* Set up the ring if it was requested and the image is not mapped, and
+   reopen the image without O_DSYNC once it is in use. */
+static void uring_start() {
+    if(!uring.requested || image_map != NULL || !uring_init(cache.data, cache.size)) {
+        return;
+    }
+    // Writes through the ring are made durable by linked fdatasync requests instead of O_DSYNC
+    int nfd = open(uring.image_path, O_RDWR);
+    if(nfd >= 0) {
+        close(fd);
+        fd = nfd;
+    }
+}
+
+/* Transfer the sectors starting at `first` between the image and `iov`
+   with one preadv()/pwritev() per IOV_MAX vectors, or through io_uring. */
+static int image_transfer(bool write, sector_t first, const struct iovec *iov, int iovcnt) {
+    if(uring.enabled) {
+        return uring_rw(write, first, iov, iovcnt);
+    }
+    off_t pos = first * di.sector_size;
+    while(iovcnt > 0) {
+        int n = min(iovcnt, IOV_MAX);
+        size_t want = 0;
+        for(int i = 0; i < n; i++) {
+            want += iov[i].iov_len;
+        }
+        ssize_t ret = write ? pwritev(fd, iov, n, pos) : preadv(fd, iov, n, pos);
+        if(ret != (ssize_t)want) {
+            return -EIO;
+        }
+        pos += want;
+        iov += n;
+        iovcnt -= n;
+    }
+    return 0;
+}
+
+/* I/O scheduler for the simulated disk. With the seek model enabled, every
+   image transfer becomes a request in a queue. The head serves one request at
+   a time; meanwhile, requests from other threads pile up and the policy picks
+   which one to serve next from the whole batch:
+     fifo:     arrival order.
+     scan:     elevator, nearest request in the current direction, reversing
+               when none is left that way.
+     clook:    nearest request at or above the head, wrapping to the lowest.
+     deadline: clook, but a request waiting past its deadline goes first. */
+enum SchedPolicy {
+    IOSCHED_FIFO = 0,
+    IOSCHED_SCAN,
+    IOSCHED_CLOOK,
+    IOSCHED_DEADLINE
+};
+static const char *sched_names[] = { "fifo", "scan", "clook", "deadline" };
+
+#define IOSCHED_READ_DEADLINE_MS  50      // Reads wait at most this long under deadline
+#define IOSCHED_WRITE_DEADLINE_MS 500     // Writes wait at most this long under deadline
+
+typedef struct io_request {
+    bool write;
+    sector_t first;
+    const struct iovec *iov;
+    int iovcnt;
+    long track;
+    uint64_t deadline;          // CLOCK_MONOTONIC, in ns
+    bool done;
+    int ret;
+    struct io_request *next;    // Pending queue, in arrival order
+} IoRequest;
+
+/* All fields are protected by `lock`. */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;        // Broadcast whenever a request completes
+    enum SchedPolicy policy;
+    IoRequest *head, **tail;    // Pending requests
+    bool busy;                  // A thread is moving the head and transferring
+    bool up;                    // Direction of scan
+    long fifo_track;            // Where the head would be when serving in arrival order
+    uint64_t requests, expired, max_batch, npending;
+    uint64_t seek_tracks;       // Tracks actually travelled
+    uint64_t fifo_tracks;       // Tracks arrival order would have travelled
+} sched = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .tail = &sched.head,
+    .up = true,
+};
+
+static uint64_t monotonic_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* Find the pending request nearest to `track` in the given direction, the
+   earliest arrival on ties. Returns the link pointing to it, or NULL. */
+static IoRequest **sched_nearest(long track, bool up) {
+    IoRequest **best = NULL;
+    for(IoRequest **link = &sched.head; *link != NULL; link = &(*link)->next) {
+        long t = (*link)->track;
+        if(up ? t < track : t > track) {
+            continue;
+        }
+        if(best == NULL || (up ? t < (*best)->track : t > (*best)->track)) {
+            best = link;
+        }
+    }
+    return best;
+}
+
+/* Remove and return the request to serve next. Caller holds `sched.lock`,
+   and the queue is not empty. */
+static IoRequest *sched_pick() {
+    IoRequest **link = NULL;
+    if(sched.policy == IOSCHED_DEADLINE) {
+        uint64_t now = monotonic_ns();
+        for(IoRequest **l = &sched.head; *l != NULL; l = &(*l)->next) {
+            if((*l)->deadline <= now && (link == NULL || (*l)->deadline < (*link)->deadline)) {
+                link = l;
+            }
+        }
+        if(link != NULL) {
+            sched.expired++;
+        }
+    }
+    if(link == NULL) {
+        switch(sched.policy) {
+        case IOSCHED_FIFO:
+            link = &sched.head;
+            break;
+        case IOSCHED_SCAN:
+            if((link = sched_nearest(di.last_track, sched.up)) == NULL) {
+                sched.up = !sched.up;
+                link = sched_nearest(di.last_track, sched.up);
+            }
+            break;
+        case IOSCHED_CLOOK:
+        case IOSCHED_DEADLINE:
+            if((link = sched_nearest(di.last_track, true)) == NULL) {
+                link = sched_nearest(0, true);
+            }
+            break;
+        }
+    }
+    IoRequest *r = *link;
+    *link = r->next;
+    if(sched.tail == &r->next) {
+        sched.tail = link;
+    }
+    sched.npending--;
+    sched.seek_tracks += labs(r->track - di.last_track);
+    return r;
+}
+
+/* Queue a transfer and wait for it. The first waiting thread that finds the
+   head idle dispatches requests, its own or others', until its own is done. */
+static int sched_submit(bool write, sector_t first, const struct iovec *iov, int iovcnt) {
+    IoRequest req = {
+        .write = write,
+        .first = first,
+        .iov = iov,
+        .iovcnt = iovcnt,
+        .track = sector_track(first),
+        .deadline = monotonic_ns() + (uint64_t)(write ? IOSCHED_WRITE_DEADLINE_MS : IOSCHED_READ_DEADLINE_MS) * 1000000,
+    };
+    pthread_mutex_lock(&sched.lock);
+    *sched.tail = &req;
+    sched.tail = &req.next;
+    sched.npending++;
+    sched.requests++;
+    sched.max_batch = max(sched.max_batch, sched.npending);
+    sched.fifo_tracks += labs(req.track - sched.fifo_track);
+    sched.fifo_track = req.track;
+    while(!req.done) {
+        if(sched.busy) {
+            pthread_cond_wait(&sched.done, &sched.lock);
+            continue;
+        }
+        IoRequest *r = sched_pick();
+        sched.busy = true;
+        pthread_mutex_unlock(&sched.lock);
+        seek_to(r->first);
+        int ret = image_transfer(r->write, r->first, r->iov, r->iovcnt);
+        pthread_mutex_lock(&sched.lock);
+        r->ret = ret;
+        r->done = true;
+        sched.busy = false;
+        pthread_cond_broadcast(&sched.done);
+    }
+    pthread_mutex_unlock(&sched.lock);
+    return req.ret;
+}
+
+/* Same as `image_transfer()`, after moving the simulated head to `first`.
+   Positional I/O needs no lock of its own; only the seek model, when it is
+   enabled, serialises requests through the scheduler the way a single disk
+   head would. */
+static int image_rw(bool write, sector_t first, const struct iovec *iov, int iovcnt) {
+    if(di.seek_time_us == 0) {
+        return image_transfer(write, first, iov, iovcnt);
+    }
+    return sched_submit(write, first, iov, iovcnt);
+}
+
+/* Write the dirty entries `dirty[0..n)`, sorted by sector, back to the
+   image with one vectored write per run of consecutive sectors. Caller holds
+   `mutex`, which is released during the writes; the entries are busy
+   meanwhile. Entries of a run that could not be written stay dirty. */
+static int cache_write_back(CacheEntry **dirty, size_t n) {
+    struct iovec *iov = malloc(n * sizeof(struct iovec));
+    bool *failed = calloc(n, sizeof(bool));
+    if(iov == NULL || failed == NULL) {
+        free(iov);
+        free(failed);
+        return -ENOMEM;
+    }
+    for(size_t i = 0; i < n; i++) {
+        iov[i].iov_base = dirty[i]->data;
+        iov[i].iov_len = di.sector_size;
+        dirty[i]->dirty = false;
+        dirty[i]->busy = true;
+    }
+    cache.ndirty -= n;
+    cache.nbusy += n;
     pthread_mutex_unlock(&mutex);
-    if(ret != PHYSICAL_SECTOR_SIZE) {
-        printf("read sector %lu error: image read failed.\n", sec_num);
-        return 1;
+    int ret = 0;
+    for(size_t i = 0; i < n; ) {
+        size_t j = i + 1;
+        while(j < n && dirty[j]->sec == dirty[j - 1]->sec + 1) {
+            j++;
+        }
+        if(image_rw(true, dirty[i]->sec, iov + i, j - i) < 0) {
+            printf("write back sectors %lu-%lu error: image write failed.\n", dirty[i]->sec, dirty[j - 1]->sec);
+            memset(failed + i, true, (j - i) * sizeof(bool));
+            ret = -EIO;
+        }
+        i = j;
+    }
+    pthread_mutex_lock(&mutex);
+    for(size_t i = 0; i < n; i++) {
+        dirty[i]->busy = false;
+        if(failed[i]) {
+            dirty[i]->dirty = true;
+            cache.ndirty++;
+        } else {
+            cache.writebacks++;
+        }
+    }
+    cache.nbusy -= n;
+    cache.generation++;
+    pthread_cond_broadcast(&cache_idle);
+    free(iov);
+    free(failed);
+    return ret;
+}
+
+/* Wait until no entry of sectors [`first`, `first` + `count`) is busy.
+   Caller holds `mutex`, which is released while waiting. */
+static void cache_wait_idle(sector_t first, size_t count) {
+    for(size_t i = 0; i < count && cache.nbusy > 0; ) {
+        CacheEntry *e = cache_peek(first + i);
+        if(e != NULL && e->busy) {
+            pthread_cond_wait(&cache_idle, &mutex);
+            i = 0;          // Entries checked before may have become busy meanwhile
+        } else {
+            i++;
+        }
+    }
+}
+
+/* Take an entry for `sec`, reusing the least recently used clean entry if
+   the cache is full. Returns NULL if none of the CACHE_EVICT_BATCH least
+   recently used entries is clean and idle, see `cache_evict_dirty()`. */
+static CacheEntry *cache_insert(sector_t sec) {
+    CacheEntry *e;
+    if(cache.used < cache.capacity) {
+        e = &cache.pool[cache.used];
+        e->data = cache.data + cache.used++ * di.sector_size;
+    } else {
+        e = cache.lru.prev;
+        for(size_t i = 0; e != &cache.lru && (e->dirty || e->busy); i++) {
+            if(i == CACHE_EVICT_BATCH) {
+                return NULL;
+            }
+            e = e->prev;
+        }
+        if(e == &cache.lru) {
+            return NULL;
+        }
+        lru_unlink(e);
+        if(e->sec != CACHE_NO_SECTOR) {
+            cache_remove_hash(e);
+        }
+    }
+    e->sec = sec;
+    e->dirty = false;
+    e->busy = false;
+    size_t h = cache_hash(sec);
+    e->hash_next = cache.buckets[h];
+    cache.buckets[h] = e;
+    lru_push_front(e);
+    return e;
+}
+
+/* Forget the cached copies of sectors [`first`, `first` + `count`), which are
+   overwritten in the image behind the cache; dirty ones are dropped too. The
+   entries move to the LRU tail to be reused first. Caller holds `mutex`. */
+static void cache_drop(sector_t first, size_t count) {
+    cache_wait_idle(first, count);  // A write-back in flight must not land after the new data
+    cache.generation++;             // Reads running now must not insert what they read
+    for(size_t i = 0; i < count; i++) {
+        CacheEntry *e = cache_peek(first + i);
+        if(e == NULL) {
+            continue;
+        }
+        if(e->dirty) {
+            e->dirty = false;
+            cache.ndirty--;
+        }
+        cache_remove_hash(e);
+        e->sec = CACHE_NO_SECTOR;
+        lru_unlink(e);
+        e->next = &cache.lru;
+        e->prev = cache.lru.prev;
+        cache.lru.prev->next = e;
+        cache.lru.prev = e;
+    }
+}
+
+static int compare_entry_sector(const void *a, const void *b) {
+    sector_t x = (*(CacheEntry * const *)a)->sec;
+    sector_t y = (*(CacheEntry * const *)b)->sec;
+    return (x > y) - (x < y);
+}
+
+/* Write dirty entries back to make room for new ones: up to
+   CACHE_EVICT_BATCH of them, least recently used first, in ascending sector
+   order. Caller holds `mutex`, which is released during the writes. Returns
+   -EBUSY if there was no idle dirty entry to write. */
+static int cache_evict_dirty() {
+    CacheEntry *dirty[CACHE_EVICT_BATCH];
+    size_t n = 0;
+    for(CacheEntry *e = cache.lru.prev; e != &cache.lru && n < CACHE_EVICT_BATCH; e = e->prev) {
+        if(e->dirty && !e->busy) {
+            dirty[n++] = e;
+        }
+    }
+    if(n == 0) {
+        return -EBUSY;
+    }
+    qsort(dirty, n, sizeof(CacheEntry *), compare_entry_sector);
+    return cache_write_back(dirty, n);
+}
+
+/* Write every dirty entry back in ascending sector order, one vectored write
+   per run of consecutive sectors, and wait for write-backs started by other
+   threads. Caller holds `mutex`, which is released during the writes. */
+static int cache_flush_locked() {
+    int ret = 0;
+    if(cache.ndirty > 0) {
+        CacheEntry **dirty = malloc(cache.ndirty * sizeof(CacheEntry *));
+        if(dirty == NULL) {
+            return -ENOMEM;
+        }
+        size_t n = 0;
+        for(size_t i = 0; i < cache.used; i++) {
+            if(cache.pool[i].dirty && !cache.pool[i].busy) {
+                dirty[n++] = &cache.pool[i];
+            }
+        }
+        qsort(dirty, n, sizeof(CacheEntry *), compare_entry_sector);
+        ret = cache_write_back(dirty, n);
+        free(dirty);
+    }
+    while(cache.nbusy > 0) {
+        pthread_cond_wait(&cache_idle, &mutex);
+    }
+    return ret;
+}
+
+/* Read sectors [`first`, `first` + `count`) through the cache. Cached sectors
+   are copied from memory; all missing ones are read by a single pread() that
+   spans from the first to the last miss. The read runs without `mutex`, so
+   readers do not wait for each other's I/O. Afterwards, a sector cached in
+   the meantime is taken from the cache, and the data read is only inserted
+   into the cache if no sector was written during the read. */
+static int cache_read(sector_t first, size_t count, char *buffer) {
+    bool *missed = malloc(count * sizeof(bool));
+    if(missed == NULL) {
+        return -ENOMEM;
+    }
+    pthread_mutex_lock(&mutex);
+    size_t lo = count, hi = 0;      // First and last missing sector
+    for(size_t i = 0; i < count; i++) {
+        CacheEntry *e = cache_lookup(first + i);
+        missed[i] = e == NULL;
+        if(e != NULL) {
+            cache.hits++;
+            memcpy(buffer + i * di.sector_size, e->data, di.sector_size);
+        } else {
+            cache.misses++;
+            lo = min(lo, i);
+            hi = i;
+        }
+    }
+    uint64_t generation = cache.generation;
+    pthread_mutex_unlock(&mutex);
+    if(lo == count) {
+        free(missed);
+        return 0;
+    }
+
+    size_t n = hi - lo + 1;
+    char *span = malloc(n * di.sector_size);
+    if(span == NULL) {
+        free(missed);
+        return -ENOMEM;
+    }
+    struct iovec iov = { span, n * di.sector_size };
+    int ret = image_rw(false, first + lo, &iov, 1);
+    if(ret < 0) {
+        free(span);
+        free(missed);
+        return ret;
+    }
+
+    pthread_mutex_lock(&mutex);
+    bool fresh = generation == cache.generation;    // Nothing written since the lookup
+    for(size_t i = lo; i <= hi; i++) {
+        if(!missed[i]) {
+            continue;
+        }
+        char *dst = buffer + i * di.sector_size;
+        const char *src = span + (i - lo) * di.sector_size;
+        CacheEntry *e = cache_peek(first + i);
+        if(e != NULL) {
+            memcpy(dst, e->data, di.sector_size);
+        } else {
+            memcpy(dst, src, di.sector_size);
+            if(fresh && (e = cache_insert(first + i)) != NULL) {
+                memcpy(e->data, src, di.sector_size);
+            }
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    free(span);
+    free(missed);
+    return 0;
+}
+
+/* Write sectors [`first`, `first` + `count`). In write-back mode they only
+   become dirty cache entries; otherwise they go to the image in one write
+   and cached copies are refreshed. Caller holds `mutex`, which is released
+   during the write to the image; cached copies are busy meanwhile, so that
+   no write-back of older data overtakes it. */
+static int cache_write(sector_t first, size_t count, const char *buffer) {
+    size_t i = 0;
+    cache.generation++;
+    if(cache.writeback) {
+        bool evicted = false;
+        while(i < count) {
+            CacheEntry *e = cache_lookup(first + i);
+            if(e != NULL && e->busy) {
+                pthread_cond_wait(&cache_idle, &mutex);
+                continue;
+            }
+            if(e == NULL && (e = cache_insert(first + i)) == NULL) {
+                if(evicted || cache_evict_dirty() < 0) {
+                    break;  // No room, write the rest through
+                }
+                evicted = true;
+                continue;   // The sector may have been cached while `mutex` was released
+            }
+            memcpy(e->data, buffer + i * di.sector_size, di.sector_size);
+            if(!e->dirty) {
+                e->dirty = true;
+                cache.ndirty++;
+            }
+            evicted = false;
+            i++;
+        }
+        if(i == count) {
+            return 0;
+        }
+    }
+    cache_wait_idle(first + i, count - i);
+    for(size_t j = i; j < count; j++) {
+        CacheEntry *e = cache_peek(first + j);
+        if(e != NULL) {
+            e->busy = true;
+            cache.nbusy++;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    struct iovec iov = { (void *)(buffer + i * di.sector_size), (count - i) * di.sector_size };
+    int ret = image_rw(true, first + i, &iov, 1);
+    pthread_mutex_lock(&mutex);
+    cache.generation++;     // Reads that missed during the write must not cache what they read
+    for(; i < count; i++) {
+        CacheEntry *e = cache_peek(first + i);
+        if(e != NULL && e->busy) {
+            if(ret == 0) {
+                memcpy(e->data, buffer + i * di.sector_size, di.sector_size);
+            }
+            e->busy = false;
+            cache.nbusy--;
+        }
+    }
+    pthread_cond_broadcast(&cache_idle);
+    return ret;
+}
+
+/* Switch to logical sectors of `size` bytes: sector numbers and transfers are
+   in this unit from now on. The cache is emptied and keeps its memory, as
+   fewer, larger entries. Called before `disk_start()`. */
+int disk_set_sector_size(size_t size) {
+    if(size < PHYSICAL_SECTOR_SIZE || size > MAX_LOGICAL_SECTOR_SIZE || (size & (size - 1)) != 0) {
+        return -EINVAL;
+    }
+    pthread_mutex_lock(&mutex);
+    int ret = cache_flush_locked();
+    if(ret == 0) {
+        di.sector_size = size;
+        di.dist_sectors = di.dist_size / size;
+        cache.capacity = cache.size / size;
+        cache.used = 0;
+        if(cache.nbuckets > 0) {
+            memset(cache.buckets, 0, cache.nbuckets * sizeof(CacheEntry *));
+        }
+        cache.lru.prev = cache.lru.next = &cache.lru;
+        cache.generation++;
+    }
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+const void *disk_map(sector_t first, size_t count) {
+    if(image_map == NULL || first + count > di.dist_sectors) {
+        return NULL;
+    }
+    return image_map + first * di.sector_size;
+}
+
+/* The image holds sectors [`first`, `first` + `count`) as the cache sees
+   them once the dirty cached ones among them are written back, so callers
+   may read them from `fd` directly. Not offered with a seek time, as such
+   reads would bypass the disk model, nor for a mapped image, which is
+   faster to copy from the mapping. */
+int disk_fd(sector_t first, size_t count, off_t *pos) {
+    if(di.seek_time_us > 0 || image_map != NULL || first + count > di.dist_sectors) {
+        return -1;
+    }
+    if(cache.capacity > 0) {
+        pthread_mutex_lock(&mutex);
+        int ret = 0;
+        for(size_t i = 0; i < count && cache.ndirty > 0 && ret == 0; ) {
+            CacheEntry *run[IOV_MAX];
+            size_t n = 0;
+            for(CacheEntry *e; i < count && n < IOV_MAX; i++) {
+                if((e = cache_peek(first + i)) != NULL && e->dirty && !e->busy) {
+                    run[n++] = e;
+                }
+            }
+            if(n > 0) {
+                ret = cache_write_back(run, n);
+            }
+        }
+        cache_wait_idle(first, count);      // Including write-backs started by other threads
+        pthread_mutex_unlock(&mutex);
+        if(ret < 0) {
+            return -1;
+        }
+    }
+    *pos = first * di.sector_size;
+    return fd;
+}
+
+int sectors_read(sector_t first, size_t count, void *buffer) {
+    if(first + count > di.dist_sectors) {
+        printf("read sectors %lu+%lu error: out of range.\n", first, count);
+        memset(buffer, 0, count * di.sector_size);
+        return -EIO;
+    }
+    if(image_map != NULL) {
+        memcpy(buffer, image_map + first * di.sector_size, count * di.sector_size);
+        return 0;
+    }
+    int ret;
+    if(cache.capacity > 0) {
+        ret = cache_read(first, count, buffer);
+    } else {
+        struct iovec iov = { buffer, count * di.sector_size };
+        ret = image_rw(false, first, &iov, 1);
+    }
+    if(ret < 0) {
+        printf("read sectors %lu+%lu error: image read failed.\n", first, count);
+        return -EIO;
+    }
+    return 0;
+}
+
+int sectors_write(sector_t first, size_t count, const void *buffer) {
+    if(first + count > di.dist_sectors) {
+        printf("write sectors %lu+%lu error: out of range.\n", first, count);
+        return -EIO;
+    }
+    if(image_map != NULL) {
+        memcpy(image_map + first * di.sector_size, buffer, count * di.sector_size);
+        return 0;
+    }
+    int ret;
+    if(cache.capacity > 0) {
+        if(pthread_mutex_lock(&mutex) != 0) {
+            printf("write sectors %lu+%lu error: lock failed.\n", first, count);
+            return -EIO;
+        }
+        ret = cache_write(first, count, buffer);
+        pthread_mutex_unlock(&mutex);
+    } else {
+        struct iovec iov = { (void *)buffer, count * di.sector_size };
+        ret = image_rw(true, first, &iov, 1);
+    }
+    if(ret < 0) {
+        printf("write sectors %lu+%lu error: image write failed.\n", first, count);
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Write sectors [`first`, `first` + `count`) with the data of `src`, which
+   fuse_buf_copy() moves into the image file without a copy in our memory
+   (spliced when `src` is a pipe). Cached copies of the sectors are dropped
+   before and after the write. With a seek time the data goes through
+   `sectors_write()` instead, to be charged to the disk model. */
+int sectors_write_buf(sector_t first, size_t count, struct fuse_bufvec *src) {
+    size_t len = count * di.sector_size;
+    if(first + count > di.dist_sectors) {
+        printf("write sectors %lu+%lu error: out of range.\n", first, count);
+        return -EIO;
+    }
+    if(di.seek_time_us > 0) {
+        char *data = malloc(len);
+        if(data == NULL) {
+            return -ENOMEM;
+        }
+        struct fuse_bufvec mem = FUSE_BUFVEC_INIT(len);
+        mem.buf[0].mem = data;
+        ssize_t n = fuse_buf_copy(&mem, src, 0);
+        int ret = n == (ssize_t)len ? sectors_write(first, count, data) : -EIO;
+        free(data);
+        return ret;
+    }
+    if(image_map == NULL && cache.capacity > 0) {
+        pthread_mutex_lock(&mutex);
+        cache_drop(first, count);
+        pthread_mutex_unlock(&mutex);
+    }
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd = fd;
+    dst.buf[0].pos = first * di.sector_size;
+    ssize_t n = fuse_buf_copy(&dst, src, 0);
+    if(image_map == NULL && cache.capacity > 0) {
+        pthread_mutex_lock(&mutex);
+        cache_drop(first, count);   // Read-ahead may have cached the old data meanwhile
+        pthread_mutex_unlock(&mutex);
+    }
+    if(n != (ssize_t)len || (uring.enabled && fdatasync(fd) != 0)) {
+        printf("write sectors %lu+%lu error: image write failed.\n", first, count);
+        return -EIO;
     }
     return 0;
 }
 
+int sector_read(sector_t sec_num, void *buffer) {
+    return sectors_read(sec_num, 1, buffer);
+}
+
 int sector_write(sector_t sec_num, const void *buffer) {
-    if(sec_num >= di.dist_sectors) {
-        printf("write sector %lu error: out of range.\n", sec_num);
-        return 1;
+    return sectors_write(sec_num, 1, buffer);
+}
+
+int disk_flush() {
+    if(image_map != NULL) {
+        return msync(image_map, di.dist_size, MS_SYNC) == 0 ? 0 : -EIO;
     }
     if(pthread_mutex_lock(&mutex) != 0) {
-        printf("write sector %lu error: lock failed.\n", sec_num);
-        return 1;
+        return -EIO;
     }
-    seek_to(sec_num);
-    ssize_t ret = pwrite(fd, buffer, PHYSICAL_SECTOR_SIZE, sec_num * PHYSICAL_SECTOR_SIZE);
+    int ret = cache_flush_locked();
     pthread_mutex_unlock(&mutex);
-    if(ret != PHYSICAL_SECTOR_SIZE) {
-        printf("write sector %lu error: image write failed.\n", sec_num);
-        return 1;
+    return ret;
+}
+
+static void *flusher_main(void *arg) {
+    pthread_mutex_lock(&mutex);
+    while(flusher_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CACHE_FLUSH_INTERVAL;
+        pthread_cond_timedwait(&flusher_cond, &mutex, &deadline);
+        cache_flush_locked();
     }
-    return 0;
+    pthread_mutex_unlock(&mutex);
+    return NULL;
 }
 
-void init_disk(const char* path, uint64_t seek_time_ns) {
-    fd = open(path, O_RDWR | O_DSYNC);
-    if(fd < 0) {
-        fprintf(stderr, "Open image file %s failed: %s\n", path, strerror(errno));
-        exit(ENOENT);
+static void *prefetch_main(void *arg) {
+    char *buffer = NULL;
+    size_t capacity = 0;
+    pthread_mutex_lock(&prefetch.lock);
+    while(true) {
+        while(prefetch.running && prefetch.len == 0) {
+            pthread_cond_wait(&prefetch.cond, &prefetch.lock);
+        }
+        if(!prefetch.running) {
+            break;
+        }
+        sector_t first = prefetch.queue[prefetch.head].first;
+        size_t count = prefetch.queue[prefetch.head].count;
+        prefetch.head = (prefetch.head + 1) % PREFETCH_QUEUE;
+        prefetch.len--;
+        pthread_mutex_unlock(&prefetch.lock);
+        if(count > capacity) {
+            free(buffer);
+            capacity = count;
+            buffer = malloc(capacity * di.sector_size);
+        }
+        if(buffer == NULL) {
+            capacity = 0;
+        } else {
+            cache_read(first, count, buffer);   // Fills the cache, the data itself is not needed
+        }
+        pthread_mutex_lock(&prefetch.lock);
+    }
+    pthread_mutex_unlock(&prefetch.lock);
+    free(buffer);
+    return NULL;
+}
+
+void disk_prefetch(sector_t first, size_t count) {
+    if(first + count > di.dist_sectors || count == 0) {
+        return;
+    }
+    if(image_map != NULL) {
+        madvise(image_map + first * di.sector_size, count * di.sector_size, MADV_WILLNEED);
+        return;
+    }
+    // Never more than half the cache, or read-ahead would evict itself
+    count = min(count, cache.capacity / 2);
+    pthread_mutex_lock(&prefetch.lock);
+    if(!prefetch.running || count == 0) {
+        pthread_mutex_unlock(&prefetch.lock);
+        return;
+    }
+    if(prefetch.len == PREFETCH_QUEUE) {
+        prefetch.dropped++;
+    } else {
+        size_t tail = (prefetch.head + prefetch.len++) % PREFETCH_QUEUE;
+        prefetch.queue[tail].first = first;
+        prefetch.queue[tail].count = count;
+        prefetch.requests++;
+        prefetch.sectors += count;
+        pthread_cond_signal(&prefetch.cond);
+    }
+    pthread_mutex_unlock(&prefetch.lock);
+}
+
+void disk_start() {
+    uring_start();
+    if(cache.capacity == 0) {
+        return;
+    }
+    prefetch.running = true;
+    if(pthread_create(&prefetch.thread, NULL, prefetch_main, NULL) != 0) {
+        fprintf(stderr, "Start read-ahead thread failed, read-ahead is disabled\n");
+        prefetch.running = false;
+    }
+    if(!cache.writeback) {
+        return;
+    }
+    flusher_running = true;
+    if(pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+        fprintf(stderr, "Start cache flusher failed, dirty sectors are written on fsync and unmount only\n");
+        flusher_running = false;
+    }
+}
+
+void disk_stop() {
+    if(prefetch.running) {
+        pthread_mutex_lock(&prefetch.lock);
+        prefetch.running = false;
+        pthread_cond_signal(&prefetch.cond);
+        pthread_mutex_unlock(&prefetch.lock);
+        pthread_join(prefetch.thread, NULL);
+    }
+    if(flusher_running) {
+        pthread_mutex_lock(&mutex);
+        flusher_running = false;
+        pthread_cond_signal(&flusher_cond);
+        pthread_mutex_unlock(&mutex);
+        pthread_join(flusher, NULL);
+    }
+    disk_flush();
+    if(cache.capacity > 0) {
+        printf("sector cache: %lu hits, %lu misses, %lu write-backs\n",
+               cache.hits, cache.misses, cache.writebacks);
+    }
+    if(prefetch.requests > 0) {
+        printf("read-ahead: %lu requests for %lu sectors, %lu dropped\n",
+               prefetch.requests, prefetch.sectors, prefetch.dropped);
+    }
+    if(di.seek_time_us > 0) {
+        printf("seek model (%s): %lu seeks, %.3f s simulated, %.1f us per request\n",
+               seek_mode_names[di.seek_mode], di.seeks, di.seek_total_us / 1e6,
+               sched.requests > 0 ? (double)di.seek_total_us / sched.requests : 0.0);
+    }
+    if(uring.enabled) {
+        printf("io_uring: %lu submissions, %lu requests, up to %lu in flight%s\n",
+               uring.submits, uring.requests, uring.max_inflight,
+               uring.fixed != NULL ? ", sector cache registered" : "");
+    }
+    if(sched.requests > 0) {
+        uint64_t saved = sched.fifo_tracks > sched.seek_tracks ? sched.fifo_tracks - sched.seek_tracks : 0;
+        printf("scheduler %s: %lu requests, batches up to %lu, %lu past deadline, "
+               "seeked %lu tracks, %lu in arrival order, %lu saved (%.1f%%)\n",
+               sched_names[sched.policy], sched.requests, sched.max_batch, sched.expired,
+               sched.seek_tracks, sched.fifo_tracks, saved,
+               sched.fifo_tracks > 0 ? 100.0 * saved / sched.fifo_tracks : 0.0);
+    }
+}
+
+/* Size the sector cache to `cache_mb` MiB of sector data; 0 disables it. */
+static void init_cache(uint64_t cache_mb, bool writeback) {
+    cache.size = cache_mb * 1024 * 1024;
+    cache.capacity = cache.size / PHYSICAL_SECTOR_SIZE;
+    cache.writeback = writeback;
+    cache.lru.prev = cache.lru.next = &cache.lru;
+    if(cache.capacity == 0) {
+        return;
+    }
+    cache.nbuckets = 1;
+    while(cache.nbuckets < cache.capacity) {
+        cache.nbuckets <<= 1;
+    }
+    cache.pool = malloc(cache.capacity * sizeof(CacheEntry));
+    cache.data = malloc(cache.size);
+    cache.buckets = calloc(cache.nbuckets, sizeof(CacheEntry *));
+    if(cache.pool == NULL || cache.data == NULL || cache.buckets == NULL) {
+        fprintf(stderr, "Allocate %lu MiB sector cache failed\n", cache_mb);
+        exit(ENOMEM);
     }
-    di.seek_time_us = seek_time_ns;
-    di.dist_size = lseek(fd, 0, SEEK_END);
-    di.dist_sectors = di.dist_size / PHYSICAL_SECTOR_SIZE;
-    di.last_track = 0;
-    di.total_track = di.dist_sectors / SEC_PER_TRACK;
 }
 
 typedef struct {
     const char* image_path;
     uint64_t seek_time_us;
+    int seek_mode;              // How simulated seeks wait, see `enum SeekMode`
+    uint64_t cache_mb;          // Size of the sector cache in MiB, 0 disables it
+    int writeback;              // Keep written sectors dirty in the cache instead of writing through
+    int sched;                  // I/O scheduler policy under the seek model, see `enum SchedPolicy`
+    int uring;                  // Use the io_uring backend instead of synchronous I/O
+    int mmap;                   // Map the image and access it through memory
+    int prewarm;                // Read and index all metadata at mount
+    int lazy;                   // Load metadata in the background after mount
 } Options;
 
+/* Map the whole image. Sectors are then copied from and to the mapping, with
+   the page cache in place of the sector cache; `disk_flush()` msync()s it.
+   Returns false if the image cannot be mapped. */
+static bool init_map() {
+    if(di.dist_size > MAX_MAPPED_IMAGE) {
+        fprintf(stderr, "Image of %ld bytes is too large for --mmap, using the sector cache\n", di.dist_size);
+        return false;
+    }
+    void *map = mmap(NULL, di.dist_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        fprintf(stderr, "Map image failed: %s, using the sector cache\n", strerror(errno));
+        return false;
+    }
+    madvise(map, di.dist_size, MADV_WILLNEED);
+    image_map = map;
+    if(di.seek_time_us > 0) {
+        fprintf(stderr, "The seek model does not apply to a mapped image\n");
+    }
+    return true;
+}
+
+void init_disk(const Options *opts) {
+    fd = open(opts->image_path, O_RDWR | O_DSYNC);
+    if(fd < 0) {
+        fprintf(stderr, "Open image file %s failed: %s\n", opts->image_path, strerror(errno));
+        exit(ENOENT);
+    }
+    di.seek_time_us = opts->seek_time_us;
+    di.seek_mode = opts->seek_mode;
+    di.sector_size = PHYSICAL_SECTOR_SIZE;     // Until the file system reads the BPB
+    di.dist_size = lseek(fd, 0, SEEK_END);
+    di.dist_sectors = di.dist_size / di.sector_size;
+    di.last_track = 0;
+    di.total_track = di.dist_size / PHYSICAL_SECTOR_SIZE / SEC_PER_TRACK;
+    sched.policy = opts->sched;
+    if(opts->mmap && init_map()) {
+        return;
+    }
+    init_cache(opts->cache_mb, opts->writeback);
+    uring.requested = opts->uring;      // Set up in `disk_start()`, after fuse_main() forked
+    uring.image_path = realpath(opts->image_path, NULL);   // The daemon runs in /
+    if(uring.image_path == NULL) {
+        uring.image_path = opts->image_path;
+    }
+}
+
 #define OPTION(t, p) { t, offsetof(Options, p), 1 }
 static const struct fuse_opt option_spec[] = {
     OPTION("--img=%s", image_path),
     OPTION("--seek_time=%lu", seek_time_us),
+    { "--seek_mode=spin", offsetof(Options, seek_mode), SEEK_MODE_SPIN },
+    { "--seek_mode=sleep", offsetof(Options, seek_mode), SEEK_MODE_SLEEP },
+    { "--seek_mode=virtual", offsetof(Options, seek_mode), SEEK_MODE_VIRTUAL },
+    OPTION("--cache_mb=%lu", cache_mb),
+    { "--writeback=on", offsetof(Options, writeback), 1 },
+    { "--writeback=off", offsetof(Options, writeback), 0 },
+    { "--sched=fifo", offsetof(Options, sched), IOSCHED_FIFO },
+    { "--sched=scan", offsetof(Options, sched), IOSCHED_SCAN },
+    { "--sched=clook", offsetof(Options, sched), IOSCHED_CLOOK },
+    { "--sched=deadline", offsetof(Options, sched), IOSCHED_DEADLINE },
+    { "--io=sync", offsetof(Options, uring), 0 },
+    { "--io=uring", offsetof(Options, uring), 1 },
+    OPTION("--mmap", mmap),
+    OPTION("--prewarm", prewarm),
+    OPTION("--lazy", lazy),
     FUSE_OPT_END
 };
 
@@ -111,12 +1439,21 @@ int main(int argc, char *argv[])
     Options opts;
     opts.image_path = strdup(DEFAULT_IMAGE);
     opts.seek_time_us = 0;
+    opts.seek_mode = SEEK_MODE_SPIN;
+    opts.cache_mb = DEFAULT_CACHE_MB;
+    opts.writeback = 1;
+    opts.sched = IOSCHED_CLOOK;
+    opts.uring = 0;
+    opts.mmap = 0;
+    opts.prewarm = 0;
+    opts.lazy = 0;
     int ret = fuse_opt_parse(&args, &opts, option_spec, NULL);
     if(ret < 0) {
         return EXIT_FAILURE;
     }
-    init_disk(opts.image_path, opts.seek_time_us);
-    ret = fuse_main(args.argc, args.argv, &fat16_oper, NULL);
+    init_disk(&opts);
+    FsOptions fs_opts = { .prewarm = opts.prewarm, .lazy = opts.lazy };
+    ret = fuse_main(args.argc, args.argv, &fat16_oper, &fs_opts);
     fuse_opt_free_args(&args);
     return ret;
 }
@@ -167,7 +167,8 @@ void time_fat_to_unix(struct timespec* ts, uint16_t date, uint16_t time, uint16_
 }
 
 void time_unix_to_fat(const struct timespec* ts, uint16_t* date, uint16_t* time, uint8_t* acc_time) {
-    struct tm* t = gmtime(&(ts->tv_sec));
+    struct tm tm;
+    struct tm* t = gmtime_r(&(ts->tv_sec), &tm);   // gmtime() is not thread-safe
     *date = 0;
     *date |= ((t->tm_year - 80) << 9);
     *date |= ((t->tm_mon + 1) << 5);
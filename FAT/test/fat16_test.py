@@ -1,12 +1,17 @@
+import errno
 import os
 import random
 import subprocess
+import tempfile
+import time
 import unittest
 from contextlib import contextmanager
 
 from generate_test_files import *
 
 FAT_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'fat16')
+FAT_IMG = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'fat16.img')
+FAT_BIN = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'fat16')
 
 def run_cmd(cmd):
     proc = subprocess.Popen(cmd, stdout=subprocess.PIPE)
@@ -23,6 +28,39 @@ def pushd(path):
         os.chdir(prev)
 
 
+def sync_fat_dir():
+    """让 FAT_DIR 上的 fat16 把缓存中的脏扇区写回镜像"""
+    with open(os.path.join(FAT_DIR, ROOT_SMALL_FILE), 'rb') as f:
+        os.fsync(f.fileno())
+
+@contextmanager
+def mount_fat16(img: str, *options: str):
+    """用给定的选项把镜像 img 挂载到一个临时目录，退出时卸载
+
+    Args:
+        img (str): 镜像文件
+        options (str): fat16 的挂载选项，如 '--io=uring'
+    """
+    mnt = tempfile.mkdtemp(prefix='fat16_mnt_')
+    proc = subprocess.Popen([FAT_BIN, '-f', mnt, f'--img={img}', *options],
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        for _ in range(100):
+            if os.path.ismount(mnt) or proc.poll() is not None:
+                break
+            time.sleep(0.1)
+        if not os.path.ismount(mnt):
+            raise RuntimeError(f'fat16 {" ".join(options)} failed to mount {img}')
+        yield mnt
+    finally:
+        subprocess.run(['fusermount', '-u', mnt])
+        try:
+            proc.wait(timeout=30)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+        os.rmdir(mnt)
+
+
 class Fat16TestCase(unittest.TestCase):
     def check_dir_exist(self, dir: str) -> None:
         self.assertTrue(os.path.exists(dir), f'Subdirectory {dir} (in directory {os.getcwd()}) does not exist.')
@@ -333,3 +371,125 @@ class Test_Task8_Write(Fat16TestCase):
             self.check_file_deleted(name)
             self.check_dir(TEST_DIR_STRUCTURE, FAT_DIR)
 
+class Test_Task9_ManyDirs(Fat16TestCase):
+    def test1_lookup_round_robin(self):
+        with pushd(FAT_DIR):
+            # 目录数远多于目录索引的容量，必然有首簇映射到同一组的目录
+            top = 'manydirs'
+            os.mkdir(top, mode=0o777)
+            n = 100
+            for i in range(n):
+                os.mkdir(os.path.join(top, f'd{i:03}'), mode=0o777)
+                with open(os.path.join(top, f'd{i:03}', f'f{i:03}.txt'), 'wb') as f:
+                    f.write(f'{i:03}'.encode('ascii'))
+            for _ in range(3):
+                for i in range(n):
+                    self.check_file_content(os.path.join(top, f'd{i:03}', f'f{i:03}.txt'), f'{i:03}'.encode('ascii'))
+                    self.check_file_deleted(os.path.join(top, f'd{i:03}', f'f{(i + 1) % n:03}.txt'))
+                self.check_dir_list(TEST_DIR_STRUCTURE | {top: {}}, '.')
+            shutil.rmtree(top)
+            self.check_dir_deleted(top)
+            self.check_dir(TEST_DIR_STRUCTURE, FAT_DIR)
+
+class Test_Task10_MountOptions(Fat16TestCase):
+    def check_mount(self, *options: str) -> None:
+        """在镜像副本上以 options 挂载，检查读写，再以默认选项重新挂载检查写入的内容"""
+        sync_fat_dir()
+        fd, img = tempfile.mkstemp(suffix='.img')
+        os.close(fd)
+        try:
+            shutil.copyfile(FAT_IMG, img)
+            name = 'mounted.txt'
+            content = LARGE_FILE_CONTENT[:4096 * 5 + 123]
+            with mount_fat16(img, *options) as mnt:
+                self.check_tree(TEST_DIR_STRUCTURE, mnt, check_content=True)
+                with pushd(mnt):
+                    with open(name, 'wb') as f:
+                        f.write(content)
+                    self.check_file_content(name, content)
+            with mount_fat16(img) as mnt:
+                with pushd(mnt):
+                    self.check_file_content(name, content)
+                self.check_dir(TEST_DIR_STRUCTURE | {name: content}, mnt, check_content=True)
+        finally:
+            os.remove(img)
+
+    def test1_io_uring(self):
+        self.check_mount('--io=uring')
+
+    def test2_mmap(self):
+        self.check_mount('--mmap')
+
+    def test3_prewarm(self):
+        self.check_mount('--prewarm')
+
+    def test4_lazy(self):
+        self.check_mount('--lazy')
+
+class Test_Task11_DelayedAllocation(Fat16TestCase):
+    def test1_append_until_full(self):
+        with pushd(FAT_DIR):
+            bfree = os.statvfs('.').f_bfree
+            names = [f'full{i}.bin' for i in range(4)]
+            chunk = bytes(range(256)) * 12
+            files = [open(name, 'wb', buffering=0) for name in names]
+            written = [0] * len(names)
+            try:
+                # 交替追加直到卷满：延迟写入的数据不能超出剩余空间
+                full = [False] * len(names)
+                while not all(full):
+                    for i, f in enumerate(files):
+                        if full[i]:
+                            continue
+                        try:
+                            n = f.write(chunk)
+                        except OSError as e:
+                            self.assertEqual(e.errno, errno.ENOSPC, f'Append to {names[i]} failed: {e}')
+                            full[i] = True
+                            continue
+                        written[i] += n
+                        full[i] = n < len(chunk)
+                # 已经写入成功的数据在关闭时落盘，不能再失败
+                for f in files:
+                    f.close()
+                self.assertGreater(sum(written), (bfree - 2 * len(names)) * os.statvfs('.').f_bsize,
+                                   'Volume not filled')
+                for name, n in zip(names, written):
+                    self.check_file_content(name, (chunk * (n // len(chunk) + 1))[:n])
+            finally:
+                for f in files:
+                    try:
+                        f.close()
+                    except OSError:
+                        pass
+                for name in names:
+                    if os.path.exists(name):
+                        os.remove(name)
+            self.assertEqual(os.statvfs('.').f_bfree, bfree, 'Free clusters not returned')
+            self.check_dir(TEST_DIR_STRUCTURE, FAT_DIR)
+
+class Test_Task12_UnlinkWhileOpen(Fat16TestCase):
+    def test1_unlink_and_recreate(self):
+        with pushd(FAT_DIR):
+            name = 'reuse.txt'
+            with open(name, 'wb') as f:
+                f.write(b'old content')
+            old = open(name, 'rb+', buffering=0)
+            try:
+                os.remove(name)
+                self.check_file_deleted(name)
+                # 新文件同名，且多半复用旧文件的目录项
+                with open(name, 'wb') as f:
+                    f.write(b'new content')
+                with self.assertRaises(OSError):
+                    old.seek(0)
+                    old.write(b'stale')
+            finally:
+                try:
+                    old.close()
+                except OSError:
+                    pass
+            self.check_file_content(name, b'new content')
+            os.remove(name)
+            self.check_file_deleted(name)
+            self.check_dir(TEST_DIR_STRUCTURE, FAT_DIR)
@@ -13,4 +13,4 @@ rm -rf ./fat16
 mkdir -p ./fat16
 make -C .. clean
 make -C .. debug
-../fat16 -s -f ./fat16 --img="./fat16.img"
+../fat16 -f ./fat16 --img="./fat16.img"
@@ -13,7 +13,7 @@ rm -rf ./fat16
 mkdir -p ./fat16
 make -C .. clean
 make -C .. debug
-../fat16 -s ./fat16 --img="./fat16.img"
+../fat16 ./fat16 --img="./fat16.img"
 
 python3 -m pytest --capture=tee-sys -x -v ./fat16_test.py
 fusermount -zu ./fat16